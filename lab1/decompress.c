@@ -0,0 +1,427 @@
+#define _POSIX_C_SOURCE 200809L
+#include "decompress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Compressed bytes read from fd at a time. */
+#define DECOMP_IN_SIZE (128 * 1024)
+/* Size of each of the two buffers the decoding thread fills in turn. */
+#define DECOMP_OUT_SIZE (256 * 1024)
+
+#ifdef HAVE_ZLIB
+static const unsigned char gzip_magic[2] = { 0x1f, 0x8b };
+#endif
+#ifdef HAVE_ZSTD
+static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+#endif
+
+struct Decoder {
+    int fd;
+    int wake[2];              /* self-pipe that interrupts reads of a pipe, or -1 */
+    int format;
+    unsigned char *in;
+    size_t in_pos, in_len, in_cap;
+    int frame_done;           /* the last gzip member or zstd frame is complete */
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zds;
+#endif
+
+    pthread_t thread;
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    char *out[2];
+    size_t out_len[2];
+    int full[2];              /* filled by the thread, not yet released by the reader */
+    int consume;              /* slot handed to the reader next */
+    int held;                 /* slot the reader holds, or -1 */
+    int finished;             /* the thread is done; what is left is in full slots */
+    int stop;                 /* decoder_close() was called */
+    char error[128];          /* why it finished early, or "" */
+
+    const char *cur;          /* decoder_read's place in the held slot */
+    size_t cur_left;
+};
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Whether p[0..n) could still grow into magic[0..m). */
+static int magic_prefix(const unsigned char *p, size_t n, const unsigned char *magic, size_t m) {
+    return memcmp(p, magic, n < m ? n : m) == 0;
+}
+#endif
+
+int decompress_format(const void *p, size_t n) {
+    const unsigned char *q = (const unsigned char*)p;
+    int maybe = 0;
+#ifdef HAVE_ZLIB
+    if (magic_prefix(q, n, gzip_magic, sizeof(gzip_magic))) {
+        if (n >= sizeof(gzip_magic)) return DECOMPRESS_GZIP;
+        maybe = 1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (magic_prefix(q, n, zstd_magic, sizeof(zstd_magic))) {
+        if (n >= sizeof(zstd_magic)) return DECOMPRESS_ZSTD;
+        maybe = 1;
+    }
+#endif
+    (void)q;
+    (void)n;
+    return maybe ? -1 : DECOMPRESS_NONE;
+}
+
+int decompress_detect(int fd, unsigned char head[DECOMPRESS_MAGIC_MAX], size_t *n) {
+    struct stat st;
+    *n = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        ssize_t got = pos < 0 ? -1 : pread(fd, head, DECOMPRESS_MAGIC_MAX, pos);
+        if (got < 0) return -1;
+        int format = decompress_format(head, (size_t)got);
+        return format < 0 ? DECOMPRESS_NONE : format;
+    }
+
+    int format = -1;
+    while (format < 0) {
+        ssize_t got = read(fd, head + *n, DECOMPRESS_MAGIC_MAX - *n);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) break;
+        *n += (size_t)got;
+        format = decompress_format(head, *n);
+    }
+    return format < 0 ? DECOMPRESS_NONE : format;
+}
+
+static void set_error(Decoder *d, const char *msg) {
+    snprintf(d->error, sizeof(d->error), "%s", msg);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/*
+ * Refills the input once it is used up. A pipe may stay silent for ever,
+ * so it is polled together with the wake pipe that decoder_close() uses.
+ * When may_block is 0, returns 1 rather than wait for a pipe, so that
+ * output decoded so far reaches the reader. Returns 0, or -1 on read
+ * error or when closed.
+ */
+static int fill_input(Decoder *d, int may_block) {
+    while (d->in_pos == d->in_len) {
+        if (d->wake[0] >= 0) {
+            struct pollfd pfd[2] = { { d->fd, POLLIN, 0 }, { d->wake[0], POLLIN, 0 } };
+            int ready = poll(pfd, 2, may_block ? -1 : 0);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                set_error(d, strerror(errno));
+                return -1;
+            }
+            if (ready == 0) return 1;
+            if (pfd[1].revents != 0) {
+                set_error(d, "cancelled");
+                return -1;
+            }
+        }
+        ssize_t got = read(d->fd, d->in, DECOMP_IN_SIZE);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            set_error(d, strerror(errno));
+            return -1;
+        }
+        d->in_pos = 0;
+        d->in_len = (size_t)got;
+        if (got == 0) break;
+    }
+    return 0;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/*
+ * Concatenated members decode as one stream. Like gzip -d, anything after
+ * a member that does not start another one is ignored.
+ */
+static int inflate_some(Decoder *d, char *out, size_t cap, size_t *len) {
+    z_stream *zs = &d->zs;
+    zs->next_out = (Bytef*)out;
+    zs->avail_out = (uInt)cap;
+    int rc = 0;
+
+    while (rc == 0 && zs->avail_out > 0) {
+        int got = fill_input(d, zs->avail_out == cap);
+        if (got < 0) rc = -1;
+        if (got != 0) break;
+        int at_eof = (d->in_pos == d->in_len);
+        if (d->frame_done) {
+            if (at_eof || d->in[d->in_pos] != gzip_magic[0]) {
+                rc = 1;
+                break;
+            }
+            inflateReset(zs);
+            d->frame_done = 0;
+        }
+
+        zs->next_in = d->in + d->in_pos;
+        zs->avail_in = (uInt)(d->in_len - d->in_pos);
+        int r = inflate(zs, Z_NO_FLUSH);
+        d->in_pos = d->in_len - zs->avail_in;
+        if (r == Z_STREAM_END) {
+            d->frame_done = 1;
+        } else if (r == Z_BUF_ERROR && at_eof) {
+            set_error(d, "unexpected end of compressed data");
+            rc = -1;
+        } else if (r != Z_OK && r != Z_BUF_ERROR) {
+            set_error(d, zs->msg ? zs->msg : "invalid compressed data");
+            rc = -1;
+        }
+    }
+    *len = cap - zs->avail_out;
+    return rc;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_some(Decoder *d, char *out, size_t cap, size_t *len) {
+    ZSTD_outBuffer ob = { out, cap, 0 };
+    int rc = 0;
+
+    while (rc == 0 && ob.pos < ob.size) {
+        int got = fill_input(d, ob.pos == 0);
+        if (got < 0) rc = -1;
+        if (got != 0) break;
+        int at_eof = (d->in_pos == d->in_len);
+        if (at_eof && d->frame_done) {
+            rc = 1;
+            break;
+        }
+
+        size_t before = ob.pos;
+        ZSTD_inBuffer ib = { d->in, d->in_len, d->in_pos };
+        size_t r = ZSTD_decompressStream(d->zds, &ob, &ib);
+        d->in_pos = ib.pos;
+        if (ZSTD_isError(r)) {
+            set_error(d, ZSTD_getErrorName(r));
+            rc = -1;
+        } else if (r == 0) {
+            d->frame_done = 1;
+        } else {
+            d->frame_done = 0;
+            if (at_eof && ob.pos == before) {
+                set_error(d, "unexpected end of compressed data");
+                rc = -1;
+            }
+        }
+    }
+    *len = ob.pos;
+    return rc;
+}
+#endif
+
+/*
+ * Decodes up to cap bytes into out and sets *len. Returns 0 if there is
+ * more, 1 at the end of the input, -1 on error.
+ */
+static int decode_some(Decoder *d, char *out, size_t cap, size_t *len) {
+    *len = 0;
+#ifdef HAVE_ZLIB
+    if (d->format == DECOMPRESS_GZIP) return inflate_some(d, out, cap, len);
+#endif
+#ifdef HAVE_ZSTD
+    if (d->format == DECOMPRESS_ZSTD) return zstd_some(d, out, cap, len);
+#endif
+    (void)out;
+    (void)cap;
+    set_error(d, "unsupported compression format");
+    return -1;
+}
+
+static void *decode_thread(void *arg) {
+    Decoder *d = (Decoder*)arg;
+    int slot = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&d->mu);
+        while (d->full[slot] && !d->stop) pthread_cond_wait(&d->cond, &d->mu);
+        int stop = d->stop;
+        pthread_mutex_unlock(&d->mu);
+        if (stop) break;
+
+        size_t len;
+        int rc = decode_some(d, d->out[slot], DECOMP_OUT_SIZE, &len);
+
+        pthread_mutex_lock(&d->mu);
+        if (len > 0) {
+            d->out_len[slot] = len;
+            d->full[slot] = 1;
+        }
+        if (rc != 0) d->finished = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->mu);
+        if (rc != 0) break;
+        if (len > 0) slot ^= 1;
+    }
+    return NULL;
+}
+
+static int codec_init(Decoder *d) {
+#ifdef HAVE_ZLIB
+    if (d->format == DECOMPRESS_GZIP) {
+        /* 16 + MAX_WBITS: gzip header and trailer. */
+        return inflateInit2(&d->zs, 16 + MAX_WBITS) == Z_OK ? 0 : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (d->format == DECOMPRESS_ZSTD) {
+        d->zds = ZSTD_createDStream();
+        if (!d->zds) return -1;
+        return ZSTD_isError(ZSTD_initDStream(d->zds)) ? -1 : 0;
+    }
+#endif
+    (void)d;
+    return -1;
+}
+
+static void codec_end(Decoder *d) {
+#ifdef HAVE_ZLIB
+    if (d->format == DECOMPRESS_GZIP) inflateEnd(&d->zs);
+#endif
+#ifdef HAVE_ZSTD
+    if (d->format == DECOMPRESS_ZSTD) ZSTD_freeDStream(d->zds);
+#endif
+    (void)d;
+}
+
+static void decoder_free(Decoder *d) {
+    if (d->wake[0] >= 0) close(d->wake[0]);
+    if (d->wake[1] >= 0) close(d->wake[1]);
+    free(d->in);
+    free(d->out[0]);
+    free(d->out[1]);
+    free(d);
+}
+
+Decoder *decoder_start(int fd, int format, const void *head, size_t n) {
+    Decoder *d = (Decoder*)calloc(1, sizeof(Decoder));
+    if (!d) return NULL;
+    d->fd = fd;
+    d->wake[0] = d->wake[1] = -1;
+    d->format = format;
+    d->held = -1;
+    d->in_cap = n > DECOMP_IN_SIZE ? n : DECOMP_IN_SIZE;
+    d->in = (unsigned char*)malloc(d->in_cap);
+    d->out[0] = (char*)malloc(DECOMP_OUT_SIZE);
+    d->out[1] = (char*)malloc(DECOMP_OUT_SIZE);
+    if (!d->in || !d->out[0] || !d->out[1]) {
+        decoder_free(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (n > 0) memcpy(d->in, head, n);
+    d->in_len = n;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (pipe(d->wake) != 0) {
+            int err = errno;
+            d->wake[0] = d->wake[1] = -1;
+            decoder_free(d);
+            errno = err;
+            return NULL;
+        }
+        fcntl(d->wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(d->wake[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (codec_init(d) != 0) {
+        codec_end(d);
+        decoder_free(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&d->mu, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    int err = pthread_create(&d->thread, NULL, decode_thread, d);
+    if (err != 0) {
+        pthread_mutex_destroy(&d->mu);
+        pthread_cond_destroy(&d->cond);
+        codec_end(d);
+        decoder_free(d);
+        errno = err;
+        return NULL;
+    }
+    return d;
+}
+
+ssize_t decoder_next(Decoder *d, const char **p) {
+    ssize_t n = 0;
+    pthread_mutex_lock(&d->mu);
+    if (d->held >= 0) {
+        d->full[d->held] = 0;
+        d->held = -1;
+        pthread_cond_broadcast(&d->cond);
+    }
+    while (!d->full[d->consume] && !d->finished) pthread_cond_wait(&d->cond, &d->mu);
+    if (d->full[d->consume]) {
+        d->held = d->consume;
+        d->consume ^= 1;
+        *p = d->out[d->held];
+        n = (ssize_t)d->out_len[d->held];
+    } else if (d->error[0] != '\0') {
+        n = -1;
+    }
+    pthread_mutex_unlock(&d->mu);
+    return n;
+}
+
+ssize_t decoder_read(Decoder *d, void *buf, size_t n) {
+    if (d->cur_left == 0) {
+        ssize_t got = decoder_next(d, &d->cur);
+        if (got <= 0) return got;
+        d->cur_left = (size_t)got;
+    }
+    size_t k = n < d->cur_left ? n : d->cur_left;
+    memcpy(buf, d->cur, k);
+    d->cur += k;
+    d->cur_left -= k;
+    return (ssize_t)k;
+}
+
+const char *decoder_error(const Decoder *d) {
+    return d->error;
+}
+
+void decoder_close(Decoder *d) {
+    if (!d) return;
+    pthread_mutex_lock(&d->mu);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mu);
+    if (d->wake[1] >= 0) {
+        /* Closing the write end wakes a thread waiting for input. */
+        close(d->wake[1]);
+        d->wake[1] = -1;
+    }
+    pthread_join(d->thread, NULL);
+
+    pthread_mutex_destroy(&d->mu);
+    pthread_cond_destroy(&d->cond);
+    codec_end(d);
+    decoder_free(d);
+}
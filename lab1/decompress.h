@@ -0,0 +1,60 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Streaming decompression for mycat and mygrep. Compressed input is told
+ * apart by its magic bytes and decoded on a separate thread into two
+ * buffers in turn, so decoding one block overlaps with the caller
+ * formatting or searching the previous one. gzip needs HAVE_ZLIB and
+ * zstd needs HAVE_ZSTD. Other input passes through unchanged.
+ */
+#define DECOMPRESS_NONE 0
+#define DECOMPRESS_GZIP 1
+#define DECOMPRESS_ZSTD 2
+
+/* Bytes needed to tell the formats apart. */
+#define DECOMPRESS_MAGIC_MAX 4
+
+typedef struct Decoder Decoder;
+
+/*
+ * Format of a stream that begins with p[0..n). Formats this build cannot
+ * decode are DECOMPRESS_NONE. Returns -1 when n is too short to tell and
+ * more input may follow.
+ */
+int decompress_format(const void *p, size_t n);
+
+/*
+ * Format of the data at fd's offset. A regular file is peeked at with
+ * pread. Anything else is read into head[0..*n), and those bytes come
+ * before the rest of fd. Reading stops as soon as the format is known,
+ * so a terminal is not held up. Returns -1 with errno set on read error.
+ */
+int decompress_detect(int fd, unsigned char head[DECOMPRESS_MAGIC_MAX], size_t *n);
+
+/*
+ * Starts decoding head[0..n) followed by the rest of fd. NULL with errno
+ * set on error.
+ */
+Decoder *decoder_start(int fd, int format, const void *head, size_t n);
+
+/*
+ * The next block of decoded data. *p stays valid until the next call.
+ * Returns its length, 0 at the end, or -1 when the input cannot be read
+ * or decoded (see decoder_error).
+ */
+ssize_t decoder_next(Decoder *d, const char **p);
+
+/* Like read(): copies up to n decoded bytes into buf. */
+ssize_t decoder_read(Decoder *d, void *buf, size_t n);
+
+/* Why decoder_next or decoder_read failed. */
+const char *decoder_error(const Decoder *d);
+
+/* Stops the decoding thread and frees d. fd is left open. */
+void decoder_close(Decoder *d);
+
+#endif
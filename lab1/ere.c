@@ -0,0 +1,971 @@
+#include "ere.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Limits on what a pattern may expand to. */
+#define ERE_DUP_MAX 255
+#define ERE_MAX_NODES 100000
+#define ERE_MAX_DEPTH 1000        /* nesting of groups and repetitions */
+#define ERE_MAX_LITERAL 255
+
+/* DFA cache size; it is flushed and rebuilt when either limit is reached. */
+#define DFA_MAX_STATES 2048
+#define DFA_ARENA_INTS (1 << 20)
+
+typedef enum { A_SET, A_CAT, A_ALT, A_STAR, A_PLUS, A_QUEST, A_REPEAT, A_BOL, A_EOL, A_EMPTY } AstType;
+
+typedef struct {
+    AstType type;
+    int left, right;          /* children; right only for A_CAT/A_ALT */
+    int set;                  /* A_SET: index into the byte-set table */
+    int min, max;             /* A_REPEAT: max < 0 means unbounded */
+    int nest;                 /* recursion depth needed to walk this node */
+} AstNode;
+
+typedef struct {
+    unsigned char bits[32];
+} ByteSet;
+
+typedef enum { N_CHAR, N_SPLIT, N_EMPTY, N_BOL, N_EOL, N_MATCH } NfaType;
+
+typedef struct {
+    unsigned char type;
+    int out, out1;
+    int set;                  /* N_CHAR */
+} NfaNode;
+
+struct Ere {
+    NfaNode *nodes;
+    int nnodes;
+    int start;
+    ByteSet *sets;
+    int nsets;
+    char literal[ERE_MAX_LITERAL + 1];
+    size_t literal_len;
+};
+
+typedef struct {
+    const char *p, *end;
+    int depth;
+    AstNode *ast;
+    int nast, ast_cap;
+    ByteSet *sets;
+    int nsets, sets_cap;
+    const char *err;
+} Parser;
+
+static int set_has(const ByteSet *s, unsigned char c) {
+    return (s->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+static void set_add(ByteSet *s, unsigned char c) {
+    s->bits[c >> 3] |= (unsigned char)(1u << (c & 7));
+}
+
+static int new_set(Parser *ps) {
+    if (ps->nsets == ps->sets_cap) {
+        int cap = ps->sets_cap ? ps->sets_cap * 2 : 16;
+        ByteSet *tmp = (ByteSet*)realloc(ps->sets, (size_t)cap * sizeof(ByteSet));
+        if (!tmp) {
+            ps->err = "memory exhausted";
+            return -1;
+        }
+        ps->sets = tmp;
+        ps->sets_cap = cap;
+    }
+    memset(&ps->sets[ps->nsets], 0, sizeof(ByteSet));
+    return ps->nsets++;
+}
+
+static int new_ast(Parser *ps, AstType type, int left, int right) {
+    if (ps->nast == ps->ast_cap) {
+        int cap = ps->ast_cap ? ps->ast_cap * 2 : 64;
+        AstNode *tmp = (AstNode*)realloc(ps->ast, (size_t)cap * sizeof(AstNode));
+        if (!tmp) {
+            ps->err = "memory exhausted";
+            return -1;
+        }
+        ps->ast = tmp;
+        ps->ast_cap = cap;
+    }
+    /*
+     * Concatenations and alternations lean left and are walked along
+     * that spine without recursion, so only their right operand nests.
+     */
+    int nest = 0;
+    if (left >= 0) nest = ps->ast[left].nest + (type != A_CAT && type != A_ALT);
+    if (right >= 0 && ps->ast[right].nest + 1 > nest) nest = ps->ast[right].nest + 1;
+    if (nest > ERE_MAX_DEPTH) {
+        ps->err = "Regular expression too big";
+        return -1;
+    }
+    AstNode *n = &ps->ast[ps->nast];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->nest = nest;
+    n->left = left;
+    n->right = right;
+    return ps->nast++;
+}
+
+static int literal_node(Parser *ps, unsigned char c) {
+    int set = new_set(ps);
+    if (set < 0) return -1;
+    set_add(&ps->sets[set], c);
+    int n = new_ast(ps, A_SET, -1, -1);
+    if (n >= 0) ps->ast[n].set = set;
+    return n;
+}
+
+static int class_matches(const char *name, size_t len, int c) {
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+        { "upper", isupper }, { "lower", islower }, { "space", isspace },
+        { "blank", isblank }, { "punct", ispunct }, { "print", isprint },
+        { "graph", isgraph }, { "cntrl", iscntrl }, { "xdigit", isxdigit },
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        if (strlen(classes[i].name) == len && memcmp(classes[i].name, name, len) == 0) {
+            return classes[i].fn(c) ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+/* One bracket element: a byte, or [.c.] / [=c=] naming one. Returns -1 on error. */
+static int bracket_char(Parser *ps) {
+    if (ps->p + 1 < ps->end && ps->p[0] == '[' && (ps->p[1] == '.' || ps->p[1] == '=')) {
+        char kind = ps->p[1];
+        if (ps->p + 4 < ps->end && ps->p[3] == kind && ps->p[4] == ']') {
+            unsigned char c = (unsigned char)ps->p[2];
+            ps->p += 5;
+            return c;
+        }
+        ps->err = "Invalid collation character";
+        return -1;
+    }
+    return (unsigned char)*ps->p++;
+}
+
+static int parse_bracket(Parser *ps) {
+    int set = new_set(ps);
+    if (set < 0) return -1;
+    ByteSet bs;
+    memset(&bs, 0, sizeof(bs));
+
+    int negate = 0;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    for (;;) {
+        if (ps->p >= ps->end) {
+            ps->err = "Unmatched [, [^, [:, [., or [=";
+            return -1;
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        first = 0;
+
+        if (ps->p + 1 < ps->end && ps->p[0] == '[' && ps->p[1] == ':') {
+            const char *name = ps->p + 2;
+            const char *q = name;
+            while (q + 1 < ps->end && !(q[0] == ':' && q[1] == ']')) q++;
+            if (q + 1 >= ps->end) {
+                ps->err = "Unmatched [, [^, [:, [., or [=";
+                return -1;
+            }
+            if (class_matches(name, (size_t)(q - name), 'a') < 0) {
+                ps->err = "Invalid character class name";
+                return -1;
+            }
+            for (int c = 0; c < 256; ++c) {
+                if (class_matches(name, (size_t)(q - name), c) > 0) set_add(&bs, (unsigned char)c);
+            }
+            ps->p = q + 2;
+            continue;
+        }
+
+        int lo = bracket_char(ps);
+        if (lo < 0) return -1;
+        int hi = lo;
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            hi = bracket_char(ps);
+            if (hi < 0) return -1;
+            if (hi < lo) {
+                ps->err = "Invalid range end";
+                return -1;
+            }
+        }
+        for (int c = lo; c <= hi; ++c) set_add(&bs, (unsigned char)c);
+    }
+
+    if (negate) {
+        for (int i = 0; i < 32; ++i) bs.bits[i] = (unsigned char)~bs.bits[i];
+    }
+    bs.bits['\n' >> 3] &= (unsigned char)~(1u << ('\n' & 7));
+    ps->sets[set] = bs;
+
+    int n = new_ast(ps, A_SET, -1, -1);
+    if (n >= 0) ps->ast[n].set = set;
+    return n;
+}
+
+static int parse_alt(Parser *ps);
+
+static int parse_atom(Parser *ps) {
+    char c = *ps->p++;
+    switch (c) {
+    case '(': {
+        if (++ps->depth > ERE_MAX_DEPTH) {
+            ps->err = "Regular expression too big";
+            return -1;
+        }
+        int n = parse_alt(ps);
+        if (n < 0) return -1;
+        if (ps->p >= ps->end || *ps->p != ')') {
+            ps->err = "Unmatched ( or \\(";
+            return -1;
+        }
+        ps->p++;
+        ps->depth--;
+        return n;
+    }
+    case '[':
+        return parse_bracket(ps);
+    case '.': {
+        int set = new_set(ps);
+        if (set < 0) return -1;
+        memset(ps->sets[set].bits, 0xff, sizeof(ps->sets[set].bits));
+        ps->sets[set].bits['\n' >> 3] &= (unsigned char)~(1u << ('\n' & 7));
+        int n = new_ast(ps, A_SET, -1, -1);
+        if (n >= 0) ps->ast[n].set = set;
+        return n;
+    }
+    case '^':
+        return new_ast(ps, A_BOL, -1, -1);
+    case '$':
+        return new_ast(ps, A_EOL, -1, -1);
+    case '\\':
+        if (ps->p >= ps->end) {
+            ps->err = "Trailing backslash";
+            return -1;
+        }
+        return literal_node(ps, (unsigned char)*ps->p++);
+    default:
+        return literal_node(ps, (unsigned char)c);
+    }
+}
+
+/* Parses "{m}", "{m,}", "{,n}" or "{m,n}" at '{'; returns 0 if it is not a bound. */
+static int parse_bound(Parser *ps, int *min, int *max) {
+    const char *q = ps->p + 1;
+    int lo = 0, hi;
+    /* "{,n}" is accepted as "{0,n}", like GNU grep does. */
+    if (q >= ps->end || !(isdigit((unsigned char)*q) || *q == ',')) return 0;
+    while (q < ps->end && isdigit((unsigned char)*q)) {
+        if (lo <= ERE_DUP_MAX) lo = lo * 10 + (*q - '0');
+        q++;
+    }
+    hi = lo;
+    if (q < ps->end && *q == ',') {
+        q++;
+        if (q < ps->end && *q == '}' && q == ps->p + 2) return 0;   /* "{,}" */
+        hi = -1;
+        if (q < ps->end && isdigit((unsigned char)*q)) {
+            hi = 0;
+            while (q < ps->end && isdigit((unsigned char)*q)) {
+                if (hi <= ERE_DUP_MAX) hi = hi * 10 + (*q - '0');
+                q++;
+            }
+        }
+    }
+    if (q >= ps->end || *q != '}') return 0;
+    if (lo > ERE_DUP_MAX || hi > ERE_DUP_MAX || (hi >= 0 && hi < lo)) {
+        ps->err = "Invalid content of \\{\\}";
+        return -1;
+    }
+    ps->p = q + 1;
+    *min = lo;
+    *max = hi;
+    return 1;
+}
+
+static int parse_repeat(Parser *ps) {
+    int n = parse_atom(ps);
+    while (n >= 0 && ps->p < ps->end) {
+        char c = *ps->p;
+        if (c == '*') {
+            ps->p++;
+            n = new_ast(ps, A_STAR, n, -1);
+        } else if (c == '+') {
+            ps->p++;
+            n = new_ast(ps, A_PLUS, n, -1);
+        } else if (c == '?') {
+            ps->p++;
+            n = new_ast(ps, A_QUEST, n, -1);
+        } else if (c == '{') {
+            int min, max;
+            int rc = parse_bound(ps, &min, &max);
+            if (rc < 0) return -1;
+            if (rc == 0) break;     /* a literal '{' */
+            n = new_ast(ps, A_REPEAT, n, -1);
+            if (n >= 0) {
+                ps->ast[n].min = min;
+                ps->ast[n].max = max;
+            }
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+static int parse_cat(Parser *ps) {
+    int n = -1;
+    while (ps->p < ps->end && *ps->p != '|' && !(*ps->p == ')' && ps->depth > 0)) {
+        if (*ps->p == ')') {
+            ps->err = "Unmatched ) or \\)";
+            return -1;
+        }
+        int r = parse_repeat(ps);
+        if (r < 0) return -1;
+        n = (n < 0) ? r : new_ast(ps, A_CAT, n, r);
+        if (n < 0) return -1;
+    }
+    return n < 0 ? new_ast(ps, A_EMPTY, -1, -1) : n;
+}
+
+static int parse_alt(Parser *ps) {
+    int n = parse_cat(ps);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int r = parse_cat(ps);
+        if (r < 0) return -1;
+        n = new_ast(ps, A_ALT, n, r);
+    }
+    return n;
+}
+
+/*
+ * Stack of pending right operands for walking A_CAT and A_ALT chains.
+ * Each walk pushes above the entries of the walks enclosing it, so one
+ * slot per AST node is enough.
+ */
+typedef struct {
+    int *items;
+    int top;
+} Spine;
+
+/* Pushes the right operands along node's left spine; returns the leftmost operand. */
+static int spine_push(Spine *sp, const Parser *ps, int node) {
+    AstType type = ps->ast[node].type;
+    while (ps->ast[node].type == type) {
+        sp->items[sp->top++] = ps->ast[node].right;
+        node = ps->ast[node].left;
+    }
+    return node;
+}
+
+/* ---- required literal ---- */
+
+static int single_byte(const ByteSet *s) {
+    int found = -1;
+    for (int c = 0; c < 256; ++c) {
+        if (set_has(s, (unsigned char)c)) {
+            if (found >= 0) return -1;
+            found = c;
+        }
+    }
+    return found;
+}
+
+typedef struct {
+    char run[ERE_MAX_LITERAL];
+    size_t run_len;
+    char best[ERE_MAX_LITERAL];
+    size_t best_len;
+} LiteralScan;
+
+static void end_run(LiteralScan *ls) {
+    if (ls->run_len > ls->best_len) {
+        memcpy(ls->best, ls->run, ls->run_len);
+        ls->best_len = ls->run_len;
+    }
+    ls->run_len = 0;
+}
+
+/*
+ * Walks a concatenation left to right collecting runs of single-byte
+ * atoms; sub-expressions that must occur at least once are searched on
+ * their own. Zero-width anchors do not break a run.
+ */
+static void scan_literal(const Parser *ps, int node, LiteralScan *ls, Spine *sp) {
+    const AstNode *n = &ps->ast[node];
+    switch (n->type) {
+    case A_CAT: {
+        int base = sp->top;
+        scan_literal(ps, spine_push(sp, ps, node), ls, sp);
+        while (sp->top > base) scan_literal(ps, sp->items[--sp->top], ls, sp);
+        return;
+    }
+    case A_SET: {
+        int c = single_byte(&ps->sets[n->set]);
+        if (c < 0) {
+            end_run(ls);
+        } else {
+            if (ls->run_len == ERE_MAX_LITERAL) end_run(ls);
+            ls->run[ls->run_len++] = (char)c;
+        }
+        return;
+    }
+    case A_BOL:
+    case A_EOL:
+    case A_EMPTY:
+        return;
+    case A_PLUS:
+    case A_REPEAT:
+        end_run(ls);
+        if (n->type == A_PLUS || n->min >= 1) {
+            LiteralScan inner;
+            memset(&inner, 0, sizeof(inner));
+            scan_literal(ps, n->left, &inner, sp);
+            end_run(&inner);
+            if (inner.best_len > ls->best_len) {
+                memcpy(ls->best, inner.best, inner.best_len);
+                ls->best_len = inner.best_len;
+            }
+        }
+        return;
+    default:
+        end_run(ls);
+        return;
+    }
+}
+
+/* ---- NFA construction ---- */
+
+typedef struct {
+    int start;
+    int out;                  /* list of dangling exits, (node << 1) | which */
+} Frag;
+
+typedef struct {
+    Ere *re;
+    int cap;
+    Spine spine;
+    const char *err;
+} Builder;
+
+static int new_node(Builder *b, NfaType type, int out, int out1, int set) {
+    if (b->re->nnodes >= ERE_MAX_NODES) {
+        b->err = "Regular expression too big";
+        return -1;
+    }
+    if (b->re->nnodes == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 256;
+        NfaNode *tmp = (NfaNode*)realloc(b->re->nodes, (size_t)cap * sizeof(NfaNode));
+        if (!tmp) {
+            b->err = "memory exhausted";
+            return -1;
+        }
+        b->re->nodes = tmp;
+        b->cap = cap;
+    }
+    NfaNode *n = &b->re->nodes[b->re->nnodes];
+    n->type = (unsigned char)type;
+    n->out = out;
+    n->out1 = out1;
+    n->set = set;
+    return b->re->nnodes++;
+}
+
+static int *exit_slot(Builder *b, int e) {
+    NfaNode *n = &b->re->nodes[e >> 1];
+    return (e & 1) ? &n->out1 : &n->out;
+}
+
+static void patch(Builder *b, int list, int target) {
+    while (list >= 0) {
+        int *slot = exit_slot(b, list);
+        int next = *slot;
+        *slot = target;
+        list = next;
+    }
+}
+
+static int append(Builder *b, int l1, int l2) {
+    if (l1 < 0) return l2;
+    int e = l1;
+    for (;;) {
+        int *slot = exit_slot(b, e);
+        if (*slot < 0) {
+            *slot = l2;
+            return l1;
+        }
+        e = *slot;
+    }
+}
+
+/* Dangling exits are chained through the out fields, -1 terminated. */
+static int single(Builder *b, NfaType type, int set, Frag *f) {
+    int n = new_node(b, type, -1, -1, set);
+    if (n < 0) return -1;
+    f->start = n;
+    f->out = n << 1;
+    return 0;
+}
+
+static int build(Builder *b, const Parser *ps, int node, Frag *f);
+
+static int build_star(Builder *b, const Parser *ps, int child, Frag *f) {
+    Frag x;
+    int split = new_node(b, N_SPLIT, -1, -1, -1);
+    if (split < 0 || build(b, ps, child, &x) != 0) return -1;
+    b->re->nodes[split].out = x.start;
+    patch(b, x.out, split);
+    f->start = split;
+    f->out = (split << 1) | 1;
+    return 0;
+}
+
+static int build_quest(Builder *b, const Parser *ps, int child, Frag *f) {
+    Frag x;
+    int split = new_node(b, N_SPLIT, -1, -1, -1);
+    if (split < 0 || build(b, ps, child, &x) != 0) return -1;
+    b->re->nodes[split].out = x.start;
+    f->start = split;
+    f->out = append(b, x.out, (split << 1) | 1);
+    return 0;
+}
+
+static void concat(Builder *b, Frag *acc, int *have, const Frag *next) {
+    if (!*have) {
+        *acc = *next;
+        *have = 1;
+    } else {
+        patch(b, acc->out, next->start);
+        acc->out = next->out;
+    }
+}
+
+static int build(Builder *b, const Parser *ps, int node, Frag *f) {
+    const AstNode *n = &ps->ast[node];
+    switch (n->type) {
+    case A_SET:
+        return single(b, N_CHAR, n->set, f);
+    case A_BOL:
+        return single(b, N_BOL, -1, f);
+    case A_EOL:
+        return single(b, N_EOL, -1, f);
+    case A_EMPTY:
+        return single(b, N_EMPTY, -1, f);
+    case A_CAT:
+    case A_ALT: {
+        Frag r;
+        int base = b->spine.top;
+        if (build(b, ps, spine_push(&b->spine, ps, node), f) != 0) return -1;
+        while (b->spine.top > base) {
+            if (build(b, ps, b->spine.items[--b->spine.top], &r) != 0) return -1;
+            if (n->type == A_CAT) {
+                patch(b, f->out, r.start);
+                f->out = r.out;
+            } else {
+                int split = new_node(b, N_SPLIT, f->start, r.start, -1);
+                if (split < 0) return -1;
+                f->start = split;
+                /* The accumulated list grows with every branch; walk the new one. */
+                f->out = append(b, r.out, f->out);
+            }
+        }
+        return 0;
+    }
+    case A_STAR:
+        return build_star(b, ps, n->left, f);
+    case A_QUEST:
+        return build_quest(b, ps, n->left, f);
+    case A_PLUS: {
+        Frag x;
+        if (build(b, ps, n->left, &x) != 0) return -1;
+        int split = new_node(b, N_SPLIT, x.start, -1, -1);
+        if (split < 0) return -1;
+        patch(b, x.out, split);
+        f->start = x.start;
+        f->out = (split << 1) | 1;
+        return 0;
+    }
+    case A_REPEAT: {
+        /* x{m,n} expands to m copies of x followed by n-m optional ones (x* if unbounded). */
+        Frag acc, part;
+        int have = 0;
+        for (int i = 0; i < n->min; ++i) {
+            if (build(b, ps, n->left, &part) != 0) return -1;
+            concat(b, &acc, &have, &part);
+        }
+        if (n->max < 0) {
+            if (build_star(b, ps, n->left, &part) != 0) return -1;
+            concat(b, &acc, &have, &part);
+        } else {
+            for (int i = n->min; i < n->max; ++i) {
+                if (build_quest(b, ps, n->left, &part) != 0) return -1;
+                concat(b, &acc, &have, &part);
+            }
+        }
+        if (!have) return single(b, N_EMPTY, -1, f);
+        *f = acc;
+        return 0;
+    }
+    }
+    return -1;
+}
+
+Ere *ere_compile(char **patterns, size_t npatterns, const char **err) {
+    Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    int root = -1;
+    int failed = 0;
+
+    for (size_t i = 0; i < npatterns && !failed; ++i) {
+        ps.p = patterns[i];
+        ps.end = patterns[i] + strlen(patterns[i]);
+        ps.depth = 0;
+        int n = parse_alt(&ps);
+        if (n >= 0 && ps.p < ps.end) {
+            ps.err = "Unmatched ) or \\)";
+            n = -1;
+        }
+        if (n >= 0) root = (root < 0) ? n : new_ast(&ps, A_ALT, root, n);
+        failed = (n < 0 || root < 0);
+    }
+    if (failed) {
+        *err = ps.err ? ps.err : "memory exhausted";
+        free(ps.ast);
+        free(ps.sets);
+        return NULL;
+    }
+
+    Ere *re = (Ere*)calloc(1, sizeof(Ere));
+    Builder b = { re, 0, { NULL, 0 }, NULL };
+    Frag f;
+    if (root >= 0) b.spine.items = (int*)malloc((size_t)ps.nast * sizeof(int));
+    if (!re || (root >= 0 && !b.spine.items)) {
+        b.err = "memory exhausted";
+    } else if (root < 0) {
+        /* No pattern at all: nothing ever matches. */
+        re->start = new_node(&b, N_CHAR, -1, -1, -1);
+        re->sets = (ByteSet*)calloc(1, sizeof(ByteSet));
+        if (re->start < 0 || !re->sets) b.err = "memory exhausted";
+        if (re->start >= 0) re->nodes[re->start].set = 0;
+        re->nsets = 1;
+    } else if (build(&b, &ps, root, &f) == 0) {
+        int match = new_node(&b, N_MATCH, -1, -1, -1);
+        if (match >= 0) {
+            patch(&b, f.out, match);
+            re->start = f.start;
+
+            LiteralScan ls;
+            memset(&ls, 0, sizeof(ls));
+            scan_literal(&ps, root, &ls, &b.spine);
+            end_run(&ls);
+            memcpy(re->literal, ls.best, ls.best_len);
+            re->literal_len = ls.best_len;
+
+            re->sets = ps.sets;
+            re->nsets = ps.nsets;
+            ps.sets = NULL;
+        }
+    }
+
+    free(b.spine.items);
+    free(ps.ast);
+    free(ps.sets);
+    if (b.err) {
+        *err = b.err;
+        ere_free(re);
+        return NULL;
+    }
+    return re;
+}
+
+void ere_free(Ere *re) {
+    if (!re) return;
+    free(re->nodes);
+    free(re->sets);
+    free(re);
+}
+
+const char *ere_required_literal(const Ere *re, size_t *len) {
+    *len = re->literal_len;
+    return re->literal;
+}
+
+/* ---- lazy DFA ---- */
+
+typedef struct {
+    int *set;                 /* sorted NFA nodes: N_CHAR, N_EOL and N_MATCH */
+    int nset;
+    unsigned hash;
+    unsigned char line_start; /* '^' still holds; kept apart from equal mid-line sets */
+    unsigned char accept;     /* a match has been seen on this line */
+    unsigned char accept_eol; /* a match completes if the line ends here */
+} DState;
+
+struct EreDfa {
+    const Ere *re;
+    DState *states;
+    int nstates;
+    int *trans;               /* DFA_MAX_STATES * 256, -1 until computed */
+    int *arena;
+    size_t arena_used;
+    int *htab;                /* open addressing, 2 * DFA_MAX_STATES slots */
+    int line_start;           /* state at the beginning of a line */
+    int *stack;
+    int *scratch;
+    int *saved;
+    unsigned *mark;
+    unsigned gen;
+};
+
+#define HTAB_SIZE (2 * DFA_MAX_STATES)
+
+static unsigned hash_set(const int *set, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; ++i) {
+        h ^= (unsigned)set[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void next_gen(EreDfa *d) {
+    if (++d->gen == 0) {
+        memset(d->mark, 0, (size_t)d->re->nnodes * sizeof(unsigned));
+        d->gen = 1;
+    }
+}
+
+/*
+ * Adds the epsilon closure of node to scratch[*n]. Line-start assertions
+ * are followed only when bol is set; line-end assertions only when eol is
+ * set, otherwise the N_EOL node itself is kept so it can be resolved once
+ * the line is known to end. Uses the current mark generation.
+ */
+static void closure(EreDfa *d, int node, int bol, int eol, int *n) {
+    const NfaNode *nodes = d->re->nodes;
+    int sp = 0;
+    d->stack[sp++] = node;
+    while (sp > 0) {
+        int s = d->stack[--sp];
+        if (s < 0 || d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        switch (nodes[s].type) {
+        case N_CHAR:
+        case N_MATCH:
+            d->scratch[(*n)++] = s;
+            break;
+        case N_EOL:
+            if (eol) d->stack[sp++] = nodes[s].out;
+            else d->scratch[(*n)++] = s;
+            break;
+        case N_BOL:
+            if (bol) d->stack[sp++] = nodes[s].out;
+            break;
+        case N_EMPTY:
+            d->stack[sp++] = nodes[s].out;
+            break;
+        case N_SPLIT:
+            d->stack[sp++] = nodes[s].out1;
+            d->stack[sp++] = nodes[s].out;
+            break;
+        }
+    }
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+static void dfa_reset(EreDfa *d) {
+    d->nstates = 0;
+    d->arena_used = 0;
+    memset(d->htab, 0xff, HTAB_SIZE * sizeof(int));
+}
+
+static int dfa_lookup(EreDfa *d, const int *set, int n, unsigned h, int is_line_start) {
+    for (unsigned i = h % HTAB_SIZE;; i = (i + 1) % HTAB_SIZE) {
+        int s = d->htab[i];
+        if (s < 0) return -1;
+        const DState *st = &d->states[s];
+        if (st->hash == h && st->nset == n && st->line_start == is_line_start &&
+            memcmp(st->set, set, (size_t)n * sizeof(int)) == 0) {
+            return s;
+        }
+    }
+}
+
+static int dfa_has_room(const EreDfa *d, int n) {
+    return d->nstates < DFA_MAX_STATES && d->arena_used + (size_t)n <= DFA_ARENA_INTS;
+}
+
+static int add_line_start(EreDfa *d);
+
+/*
+ * Interns scratch[0..n) as a state. When the cache is full it is flushed
+ * and rebuilt around the line-start state and the new one; *flushed tells
+ * the caller that previously returned state numbers are gone.
+ */
+static int dfa_intern(EreDfa *d, int n, int is_line_start, int *flushed) {
+    qsort(d->scratch, (size_t)n, sizeof(int), cmp_int);
+    unsigned h = hash_set(d->scratch, n);
+    int s = dfa_lookup(d, d->scratch, n, h, is_line_start);
+    if (s >= 0) return s;
+
+    if (!dfa_has_room(d, n)) {
+        memcpy(d->saved, d->scratch, (size_t)n * sizeof(int));
+        dfa_reset(d);
+        add_line_start(d);
+        memcpy(d->scratch, d->saved, (size_t)n * sizeof(int));
+        *flushed = 1;
+        s = dfa_lookup(d, d->scratch, n, h, is_line_start);
+        if (s >= 0) return s;
+    }
+
+    s = d->nstates++;
+    DState *st = &d->states[s];
+    st->set = d->arena + d->arena_used;
+    memcpy(st->set, d->scratch, (size_t)n * sizeof(int));
+    d->arena_used += (size_t)n;
+    st->nset = n;
+    st->hash = h;
+    st->line_start = (unsigned char)is_line_start;
+    memset(d->trans + (size_t)s * 256, 0xff, 256 * sizeof(int));
+
+    const NfaNode *nodes = d->re->nodes;
+    st->accept = 0;
+    for (int i = 0; i < n; ++i) {
+        if (nodes[st->set[i]].type == N_MATCH) st->accept = 1;
+    }
+    st->accept_eol = st->accept;
+    if (!st->accept) {
+        /* Resolve pending '$' as if the line ended here; scratch is no longer needed. */
+        int m = 0;
+        next_gen(d);
+        for (int i = 0; i < n && !st->accept_eol; ++i) {
+            if (nodes[st->set[i]].type != N_EOL) continue;
+            closure(d, nodes[st->set[i]].out, is_line_start, 1, &m);
+            for (int k = 0; k < m; ++k) {
+                if (nodes[d->scratch[k]].type == N_MATCH) st->accept_eol = 1;
+            }
+            m = 0;
+        }
+    }
+
+    for (unsigned i = h % HTAB_SIZE;; i = (i + 1) % HTAB_SIZE) {
+        if (d->htab[i] < 0) {
+            d->htab[i] = s;
+            break;
+        }
+    }
+    return s;
+}
+
+static int add_line_start(EreDfa *d) {
+    int n = 0;
+    int flushed = 0;
+    next_gen(d);
+    closure(d, d->re->start, 1, 0, &n);
+    d->line_start = dfa_intern(d, n, 1, &flushed);
+    return d->line_start;
+}
+
+/*
+ * Computes the successor of state s on byte c (never '\n'): the NFA nodes
+ * reached by consuming c, plus a fresh start since the match may begin at
+ * any position.
+ */
+static int dfa_step(EreDfa *d, int s, unsigned char c) {
+    const NfaNode *nodes = d->re->nodes;
+    const DState *st = &d->states[s];
+    int n = 0;
+
+    next_gen(d);
+    for (int i = 0; i < st->nset; ++i) {
+        const NfaNode *nd = &nodes[st->set[i]];
+        if (nd->type == N_CHAR && set_has(&d->re->sets[nd->set], c)) {
+            closure(d, nd->out, 0, 0, &n);
+        }
+    }
+    closure(d, d->re->start, 0, 0, &n);
+
+    int flushed = 0;
+    int t = dfa_intern(d, n, 0, &flushed);
+    if (!flushed) d->trans[(size_t)s * 256 + c] = t;
+    return t;
+}
+
+EreDfa *ere_dfa_new(const Ere *re) {
+    EreDfa *d = (EreDfa*)calloc(1, sizeof(EreDfa));
+    if (!d) return NULL;
+    size_t nn = (size_t)re->nnodes;
+    d->re = re;
+    d->states = (DState*)malloc(DFA_MAX_STATES * sizeof(DState));
+    d->trans = (int*)malloc((size_t)DFA_MAX_STATES * 256 * sizeof(int));
+    d->arena = (int*)malloc(DFA_ARENA_INTS * sizeof(int));
+    d->htab = (int*)malloc(HTAB_SIZE * sizeof(int));
+    d->stack = (int*)malloc((2 * nn + 2) * sizeof(int));
+    d->scratch = (int*)malloc((nn + 1) * sizeof(int));
+    d->saved = (int*)malloc((nn + 1) * sizeof(int));
+    d->mark = (unsigned*)calloc(nn + 1, sizeof(unsigned));
+    if (!d->states || !d->trans || !d->arena || !d->htab || !d->stack || !d->scratch || !d->saved || !d->mark ||
+        nn > DFA_ARENA_INTS) {
+        ere_dfa_free(d);
+        return NULL;
+    }
+    dfa_reset(d);
+    add_line_start(d);
+    return d;
+}
+
+void ere_dfa_free(EreDfa *d) {
+    if (!d) return;
+    free(d->states);
+    free(d->trans);
+    free(d->arena);
+    free(d->htab);
+    free(d->stack);
+    free(d->scratch);
+    free(d->saved);
+    free(d->mark);
+    free(d);
+}
+
+const char *ere_find(EreDfa *d, const char *p, size_t n) {
+    const unsigned char *q = (const unsigned char*)p;
+    int s = d->line_start;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (d->states[s].accept) return p + i;
+        if (q[i] == '\n') {
+            if (d->states[s].accept_eol) return p + i;
+            s = d->line_start;
+            continue;
+        }
+        int t = d->trans[(size_t)s * 256 + q[i]];
+        s = (t >= 0) ? t : dfa_step(d, s, q[i]);
+    }
+    /* An unterminated last line, which may be empty. */
+    if (n == 0 || q[n - 1] != '\n') {
+        if (d->states[s].accept || d->states[s].accept_eol) return n > 0 ? p + n - 1 : p;
+    }
+    return NULL;
+}
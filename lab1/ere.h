@@ -0,0 +1,39 @@
+#ifndef ERE_H
+#define ERE_H
+
+#include <stddef.h>
+
+/*
+ * POSIX extended regular expressions for mygrep -E. Patterns compile to a
+ * Thompson NFA that is matched through a lazily built DFA, so matching is
+ * linear in the input whatever the pattern. The compiled Ere is read-only;
+ * every thread that matches needs its own EreDfa, which holds the bounded
+ * cache of DFA states.
+ */
+typedef struct Ere Ere;
+typedef struct EreDfa EreDfa;
+
+/*
+ * Compiles the patterns as alternatives of a single expression. On error
+ * returns NULL and points *err at a static message.
+ */
+Ere *ere_compile(char **patterns, size_t npatterns, const char **err);
+void ere_free(Ere *re);
+
+/*
+ * A literal that every match contains, for prefiltering with a substring
+ * search. Sets *len to 0 when there is none.
+ */
+const char *ere_required_literal(const Ere *re, size_t *len);
+
+EreDfa *ere_dfa_new(const Ere *re);
+void ere_dfa_free(EreDfa *dfa);
+
+/*
+ * Searches p[0..n), which must start at the beginning of a line, for the
+ * first line containing a match. Returns a pointer into that line (possibly
+ * to its terminating '\n') or NULL.
+ */
+const char *ere_find(EreDfa *dfa, const char *p, size_t n);
+
+#endif
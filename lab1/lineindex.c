@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+#include "lineindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LINEINDEX_VERSION 1
+/* Bloom filter per block: 2^15 bits, two bits set per trigram. */
+#define BLOOM_BYTES 4096
+#define BLOOM_BITS (BLOOM_BYTES * 8)
+/*
+ * Trigrams starting this far into the next block are added to a block too,
+ * so an occurrence that starts in a block and runs across its end is
+ * still found through its first OVERLAP + 1 trigrams.
+ */
+#define OVERLAP 64
+/* Read size while building and seeking. */
+#define SCAN_BUF_SIZE (1024 * 1024)
+
+/* The block holds a '\r' followed by something other than '\n' or '\r'. */
+#define BLOCK_INNER_CR 1
+
+static const char index_magic[8] = "LINEIDX";
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sample_every;
+    uint32_t block_size;
+    uint32_t bloom_bytes;
+    uint32_t overlap;
+    uint32_t reserved;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t nsamples;
+    uint64_t nblocks;
+} IndexHeader;
+
+struct LineIndex {
+    IndexHeader hdr;
+    uint64_t *sample_off;     /* start of line k * LINEINDEX_SAMPLE */
+    uint64_t *sample_nonblank;/* non-blank lines before it */
+    uint64_t *block_line;     /* start of the line holding each block's first byte */
+    unsigned char *block_flags;
+    unsigned char *blooms;    /* BLOOM_BYTES per block */
+};
+
+static void trigram_bits(uint32_t t, uint32_t *h1, uint32_t *h2) {
+    uint64_t h = (uint64_t)t * 0x9E3779B97F4A7C15ull;
+    *h1 = (uint32_t)(h >> 49);
+    *h2 = (uint32_t)(h >> 20) & (BLOOM_BITS - 1);
+}
+
+static void bloom_add(unsigned char *bloom, uint32_t t) {
+    uint32_t h1, h2;
+    trigram_bits(t, &h1, &h2);
+    bloom[h1 >> 3] |= (unsigned char)(1u << (h1 & 7));
+    bloom[h2 >> 3] |= (unsigned char)(1u << (h2 & 7));
+}
+
+static int bloom_has(const unsigned char *bloom, uint32_t t) {
+    uint32_t h1, h2;
+    trigram_bits(t, &h1, &h2);
+    return ((bloom[h1 >> 3] >> (h1 & 7)) & (bloom[h2 >> 3] >> (h2 & 7)) & 1) != 0;
+}
+
+void lineindex_free(LineIndex *idx) {
+    if (!idx) return;
+    free(idx->sample_off);
+    free(idx->sample_nonblank);
+    free(idx->block_line);
+    free(idx->block_flags);
+    free(idx->blooms);
+    free(idx);
+}
+
+static void header_init(IndexHeader *hdr, const struct stat *st) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, index_magic, sizeof(hdr->magic));
+    hdr->version = LINEINDEX_VERSION;
+    hdr->sample_every = LINEINDEX_SAMPLE;
+    hdr->block_size = LINEINDEX_BLOCK;
+    hdr->bloom_bytes = BLOOM_BYTES;
+    hdr->overlap = OVERLAP;
+    hdr->file_size = (uint64_t)st->st_size;
+    hdr->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    hdr->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    hdr->nblocks = ((uint64_t)st->st_size + LINEINDEX_BLOCK - 1) / LINEINDEX_BLOCK;
+}
+
+static int alloc_blocks(LineIndex *idx) {
+    size_t n = (size_t)idx->hdr.nblocks;
+    idx->block_line = (uint64_t*)malloc((n ? n : 1) * sizeof(uint64_t));
+    idx->block_flags = (unsigned char*)calloc(n ? n : 1, 1);
+    idx->blooms = (unsigned char*)calloc(n ? n : 1, BLOOM_BYTES);
+    return (idx->block_line && idx->block_flags && idx->blooms) ? 0 : -1;
+}
+
+static int alloc_samples(LineIndex *idx, size_t n) {
+    uint64_t *off = (uint64_t*)realloc(idx->sample_off, (n ? n : 1) * sizeof(uint64_t));
+    if (!off) return -1;
+    idx->sample_off = off;
+    uint64_t *nb = (uint64_t*)realloc(idx->sample_nonblank, (n ? n : 1) * sizeof(uint64_t));
+    if (!nb) return -1;
+    idx->sample_nonblank = nb;
+    return 0;
+}
+
+/* A '\r' at pos may change what matches in its block and in the overlap of the one before. */
+static void flag_inner_cr(LineIndex *idx, uint64_t pos) {
+    uint64_t b = pos / LINEINDEX_BLOCK;
+    idx->block_flags[b] |= BLOCK_INNER_CR;
+    if (b > 0 && pos % LINEINDEX_BLOCK < OVERLAP + 2) idx->block_flags[b - 1] |= BLOCK_INNER_CR;
+}
+
+/* Reads the whole file once, filling in the samples and the per-block summaries. */
+static int scan_file(LineIndex *idx, int fd) {
+    char *buf = (char*)malloc(SCAN_BUF_SIZE);
+    size_t samples_cap = 64;
+    if (!buf || alloc_blocks(idx) != 0 || alloc_samples(idx, samples_cap) != 0) {
+        free(buf);
+        return -1;
+    }
+
+    uint64_t size = idx->hdr.file_size;
+    uint64_t pos = 0, line = 0, nonblank = 0, line_start = 0;
+    uint32_t tri = 0;
+    int at_line_start = 1, prev_cr = 0;
+    int rc = 0;
+
+    while (rc == 0 && pos < size) {
+        ssize_t n = pread(fd, buf, SCAN_BUF_SIZE, (off_t)pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) break;
+        if ((uint64_t)n > size - pos) n = (ssize_t)(size - pos);
+
+        for (ssize_t i = 0; i < n; ++i, ++pos) {
+            unsigned char c = (unsigned char)buf[i];
+            if (at_line_start) {
+                if (line % LINEINDEX_SAMPLE == 0) {
+                    size_t k = (size_t)(line / LINEINDEX_SAMPLE);
+                    if (k == samples_cap) {
+                        samples_cap *= 2;
+                        if (alloc_samples(idx, samples_cap) != 0) {
+                            rc = -1;
+                            break;
+                        }
+                    }
+                    idx->sample_off[k] = pos;
+                    idx->sample_nonblank[k] = nonblank;
+                    idx->hdr.nsamples = k + 1;
+                }
+                if (c != '\n') nonblank++;
+                line++;
+                line_start = pos;
+                at_line_start = 0;
+            }
+            if (pos % LINEINDEX_BLOCK == 0) idx->block_line[pos / LINEINDEX_BLOCK] = line_start;
+            if (prev_cr && c != '\n' && c != '\r') flag_inner_cr(idx, pos - 1);
+            prev_cr = (c == '\r');
+
+            tri = ((tri << 8) | c) & 0xFFFFFF;
+            if (pos >= 2) {
+                uint64_t start = pos - 2;
+                uint64_t b = start / LINEINDEX_BLOCK;
+                bloom_add(idx->blooms + b * BLOOM_BYTES, tri);
+                if (b > 0 && start % LINEINDEX_BLOCK < OVERLAP) {
+                    bloom_add(idx->blooms + (b - 1) * BLOOM_BYTES, tri);
+                }
+            }
+            if (c == '\n') at_line_start = 1;
+        }
+    }
+    free(buf);
+    if (rc == 0 && pos != size) {
+        errno = EIO;          /* the file shrank while it was indexed */
+        rc = -1;
+    }
+    return rc;
+}
+
+static LineIndex *build_index(int fd, const struct stat *st) {
+    LineIndex *idx = (LineIndex*)calloc(1, sizeof(LineIndex));
+    if (!idx) return NULL;
+    header_init(&idx->hdr, st);
+    if (scan_file(idx, fd) != 0) {
+        lineindex_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static int read_full(int fd, void *p, size_t n) {
+    char *q = (char*)p;
+    while (n > 0) {
+        ssize_t r = read(fd, q, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        q += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *p, size_t n) {
+    const char *q = (const char*)p;
+    while (n > 0) {
+        ssize_t r = write(fd, q, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        q += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+/* Reads a sidecar into idx; fails unless this version wrote it for the file as it is now. */
+static int read_index(LineIndex *idx, int fd, const struct stat *st) {
+    IndexHeader want;
+    header_init(&want, st);
+    IndexHeader *hdr = &idx->hdr;
+    if (read_full(fd, hdr, sizeof(*hdr)) != 0) return -1;
+    want.nsamples = hdr->nsamples;
+    if (memcmp(hdr, &want, sizeof(want)) != 0) return -1;
+    if (hdr->nsamples > hdr->file_size / LINEINDEX_SAMPLE + 1) return -1;
+
+    size_t ns = (size_t)hdr->nsamples, nb = (size_t)hdr->nblocks;
+    if (alloc_blocks(idx) != 0 || alloc_samples(idx, ns) != 0) return -1;
+    if (read_full(fd, idx->sample_off, ns * sizeof(uint64_t)) != 0 ||
+        read_full(fd, idx->sample_nonblank, ns * sizeof(uint64_t)) != 0 ||
+        read_full(fd, idx->block_line, nb * sizeof(uint64_t)) != 0 ||
+        read_full(fd, idx->block_flags, nb) != 0 ||
+        read_full(fd, idx->blooms, nb * BLOOM_BYTES) != 0) return -1;
+    return 0;
+}
+
+static LineIndex *load_index(const char *sidecar, const struct stat *st) {
+    int fd = open(sidecar, O_RDONLY);
+    if (fd < 0) return NULL;
+    LineIndex *idx = (LineIndex*)calloc(1, sizeof(LineIndex));
+    if (idx && read_index(idx, fd, st) != 0) {
+        lineindex_free(idx);
+        idx = NULL;
+    }
+    close(fd);
+    return idx;
+}
+
+/* Written to a temporary name and renamed, so readers never see half an index. */
+static void save_index(const LineIndex *idx, const char *sidecar) {
+    size_t len = strlen(sidecar) + 32;
+    char *tmp = (char*)malloc(len);
+    if (!tmp) return;
+    snprintf(tmp, len, "%s.%ld.tmp", sidecar, (long)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+    size_t ns = (size_t)idx->hdr.nsamples, nb = (size_t)idx->hdr.nblocks;
+    int rc = write_full(fd, &idx->hdr, sizeof(idx->hdr));
+    if (rc == 0) rc = write_full(fd, idx->sample_off, ns * sizeof(uint64_t));
+    if (rc == 0) rc = write_full(fd, idx->sample_nonblank, ns * sizeof(uint64_t));
+    if (rc == 0) rc = write_full(fd, idx->block_line, nb * sizeof(uint64_t));
+    if (rc == 0) rc = write_full(fd, idx->block_flags, nb);
+    if (rc == 0) rc = write_full(fd, idx->blooms, nb * BLOOM_BYTES);
+    if (close(fd) != 0) rc = -1;
+    if (rc != 0 || rename(tmp, sidecar) != 0) unlink(tmp);
+    free(tmp);
+}
+
+LineIndex *lineindex_open(int fd, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t len = strlen(path) + sizeof(".lidx");
+    char *sidecar = (char*)malloc(len);
+    if (!sidecar) return NULL;
+    snprintf(sidecar, len, "%s.lidx", path);
+
+    LineIndex *idx = load_index(sidecar, &st);
+    if (!idx) {
+        idx = build_index(fd, &st);
+        if (idx) save_index(idx, sidecar);
+    }
+    free(sidecar);
+    return idx;
+}
+
+uint64_t lineindex_file_size(const LineIndex *idx) {
+    return idx->hdr.file_size;
+}
+
+uint64_t lineindex_nblocks(const LineIndex *idx) {
+    return idx->hdr.nblocks;
+}
+
+off_t lineindex_block_line_start(const LineIndex *idx, uint64_t b) {
+    return (off_t)idx->block_line[b];
+}
+
+int lineindex_block_may_contain(const LineIndex *idx, uint64_t b, const char *s, size_t n) {
+    if (n < 3 || (idx->block_flags[b] & BLOCK_INNER_CR)) return 1;
+    const unsigned char *bloom = idx->blooms + b * BLOOM_BYTES;
+    const unsigned char *q = (const unsigned char*)s;
+    size_t last = n - 3 < OVERLAP ? n - 3 : OVERLAP;
+    for (size_t j = 0; j <= last; ++j) {
+        uint32_t t = ((uint32_t)q[j] << 16) | ((uint32_t)q[j + 1] << 8) | q[j + 2];
+        if (!bloom_has(bloom, t)) return 0;
+    }
+    return 1;
+}
+
+size_t lineindex_skip_lines(const char *p, size_t n, uint64_t *left, uint64_t *nonblank, int *at_start) {
+    const char *q = p, *end = p + n;
+    while (q < end && *left > 0) {
+        if (*at_start) {
+            if (*q != '\n') (*nonblank)++;
+            *at_start = 0;
+        }
+        const char *nl = (const char*)memchr(q, '\n', (size_t)(end - q));
+        if (!nl) return n;
+        q = nl + 1;
+        (*left)--;
+        *at_start = 1;
+    }
+    return (size_t)(q - p);
+}
+
+int lineindex_seek(const LineIndex *idx, int fd, uint64_t line, off_t *off, uint64_t *nonblank) {
+    off_t pos = 0;
+    uint64_t nb = 0, left = line;
+    if (idx && idx->hdr.nsamples > 0) {
+        uint64_t k = line / LINEINDEX_SAMPLE;
+        if (k >= idx->hdr.nsamples) k = idx->hdr.nsamples - 1;
+        pos = (off_t)idx->sample_off[k];
+        nb = idx->sample_nonblank[k];
+        left = line - k * LINEINDEX_SAMPLE;
+    }
+
+    char *buf = left > 0 ? (char*)malloc(SCAN_BUF_SIZE) : NULL;
+    if (left > 0 && !buf) return -1;
+    int at_start = 1;
+    while (left > 0) {
+        ssize_t n = pread(fd, buf, SCAN_BUF_SIZE, pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        if (n == 0) break;
+        pos += (off_t)lineindex_skip_lines(buf, (size_t)n, &left, &nb, &at_start);
+    }
+    free(buf);
+    *off = pos;
+    *nonblank = nb;
+    return 0;
+}
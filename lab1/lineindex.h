@@ -0,0 +1,62 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Sidecar index for files that do not change, such as rotated logs, kept
+ * next to FILE as FILE.lidx. It samples the offset of every
+ * LINEINDEX_SAMPLE-th line, so mycat can start at any line without scanning
+ * from the top. It also summarises every LINEINDEX_BLOCK bytes with a Bloom
+ * filter of byte trigrams, so mygrep can skip blocks that cannot contain a
+ * pattern. The header records the format version and the file's size and
+ * mtime. An index that no longer matches is rebuilt.
+ */
+#define LINEINDEX_SAMPLE 4096
+#define LINEINDEX_BLOCK (64 * 1024)
+
+typedef struct LineIndex LineIndex;
+
+/*
+ * Returns the index of the regular file open as fd, loaded from path's
+ * sidecar when it is current. Otherwise it is built by reading fd and
+ * saved for next time if the directory is writable. NULL with errno set
+ * on error.
+ */
+LineIndex *lineindex_open(int fd, const char *path);
+void lineindex_free(LineIndex *idx);
+
+uint64_t lineindex_file_size(const LineIndex *idx);
+uint64_t lineindex_nblocks(const LineIndex *idx);
+
+/* Start of the line that holds the first byte of block b. */
+off_t lineindex_block_line_start(const LineIndex *idx, uint64_t b);
+
+/*
+ * Zero only if no occurrence of s[0..n) starts inside block b. Strings
+ * shorter than a trigram may always occur. So may anything in a block
+ * with a '\r' inside a line, since mygrep matches lines with their '\r's
+ * removed.
+ */
+int lineindex_block_may_contain(const LineIndex *idx, uint64_t b, const char *s, size_t n);
+
+/*
+ * Finds where line `line` (counted from 0) starts and how many non-blank
+ * lines, those not starting with '\n', come before it. The scan reads
+ * forward from the nearest sample, or from the top when idx is NULL. Past
+ * the last line, *off is the end of the file. Returns 0, or -1 with errno
+ * set when reading fails.
+ */
+int lineindex_seek(const LineIndex *idx, int fd, uint64_t line, off_t *off, uint64_t *nonblank);
+
+/*
+ * Scanning step shared with readers that cannot seek: skips up to *left
+ * lines of p[0..n) and returns the number of bytes consumed. *left and
+ * *nonblank are updated. *at_start tells whether p begins a line and
+ * carries over to the next call.
+ */
+size_t lineindex_skip_lines(const char *p, size_t n, uint64_t *left, uint64_t *nonblank, int *at_start);
+
+#endif
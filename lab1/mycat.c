@@ -1,63 +1,825 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "decompress.h"
+#include "lineindex.h"
+
+/* Size of a single read() and the output flush threshold. */
+#define IO_BUF_SIZE (128 * 1024)
+/* Upper bound for one copy_file_range/sendfile/splice call. */
+#define ZERO_COPY_CHUNK (1 << 30)
+/* Regular files at least this large are memory-mapped unless --no-mmap. */
+#define MMAP_MIN_SIZE (16 * 1024 * 1024)
+/* Portion of a mapping that is prefetched and released at a time. */
+#define MMAP_WINDOW (16 * 1024 * 1024)
+/* Slice of a file handled by one worker in the parallel -n/-b/-E mode. */
+#define PAR_CHUNK (8 * 1024 * 1024)
+/* Regular files up to this size are read whole by the prefetch workers. */
+#define PREFETCH_MAX_SIZE (256 * 1024)
+/* Files that may be opened or read ahead of the output, per worker. */
+#define PREFETCH_SLOTS_PER_JOB 8
 
 typedef struct {
     int number_all_lines;     /* -n */
     int number_nonblank;      /* -b */
     int show_ends;            /* -E */
+    int use_mmap;             /* --mmap: 1, --no-mmap: 0, by size: -1 */
+    int jobs;                 /* -j N: worker threads */
+    long long from_line;      /* --from=N: first line written, counted from 1 */
+    int use_index;            /* --index: seek through FILE.lidx, building it if needed */
 } CatOptions;
 
+/* Line numbering state carried across blocks of one file. */
+typedef struct {
+    long long line_no;
+    int at_line_start;
+} LineState;
+
+/* Growable output buffer; when fd >= 0 it is written out once it fills up. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int fd;
+    mode_t fd_type;     /* S_IFMT bits of fd, 0 when unknown */
+} OutBuf;
+
 static void print_usage(const char *progname) {
-    fprintf(stderr, "Usage: %s [-n] [-b] [-E] [FILE ...]\n", progname);
+    fprintf(stderr, "Usage: %s [-n] [-b] [-E] [-j N] [--mmap|--no-mmap] [--index] [--from=N] [FILE ...]\n",
+            progname);
     fprintf(stderr, "       %s [--] [FILE ...]\n", progname);
 }
 
-static int process_stream(FILE *fp, const char *name, const CatOptions *opts) {
-    int c;
-    int exit_code = 0;
-    long long line_no = 1;
-    int at_line_start = 1;
+static int needs_transform(const CatOptions *opts) {
+    return opts->number_all_lines || opts->number_nonblank || opts->show_ends;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
 
-    while ((c = fgetc(fp)) != EOF) {
-        if (at_line_start) {
+static int out_flush(OutBuf *out) {
+    if (out->fd < 0 || out->len == 0) return 0;
+    int rc = write_all(out->fd, out->data, out->len);
+    out->len = 0;
+    return rc;
+}
+
+static int out_reserve(OutBuf *out, size_t n) {
+    if (out->len + n <= out->cap) return 0;
+    if (out->fd >= 0 && out->len > 0) {
+        if (out_flush(out) != 0) return -1;
+        if (n <= out->cap) return 0;
+    }
+    size_t new_cap = out->cap ? out->cap : IO_BUF_SIZE;
+    while (new_cap < out->len + n) new_cap *= 2;
+    char *tmp = (char*)realloc(out->data, new_cap);
+    if (!tmp) return -1;
+    out->data = tmp;
+    out->cap = new_cap;
+    return 0;
+}
+
+static int out_write(OutBuf *out, const char *p, size_t n) {
+    if (out->fd >= 0 && n >= (out->cap ? out->cap : IO_BUF_SIZE)) {
+        /* Large spans bypass the buffer entirely. */
+        if (out_flush(out) != 0) return -1;
+        return write_all(out->fd, p, n);
+    }
+    if (out_reserve(out, n) != 0) return -1;
+    memcpy(out->data + out->len, p, n);
+    out->len += n;
+    return 0;
+}
+
+static int out_putc(OutBuf *out, char c) {
+    if (out_reserve(out, 1) != 0) return -1;
+    out->data[out->len++] = c;
+    return 0;
+}
+
+/* Same output as printf("%6lld\t", n). */
+static int out_line_number(OutBuf *out, long long n) {
+    char digits[24];
+    int nd = 0;
+    unsigned long long v = (unsigned long long)n;
+    do {
+        digits[nd++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+
+    int pad = nd < 6 ? 6 - nd : 0;
+    if (out_reserve(out, (size_t)(pad + nd + 1)) != 0) return -1;
+    char *dst = out->data + out->len;
+    for (int k = 0; k < pad; ++k) *dst++ = ' ';
+    while (nd > 0) *dst++ = digits[--nd];
+    *dst++ = '\t';
+    out->len = (size_t)(dst - out->data);
+    return 0;
+}
+
+/*
+ * Applies -n/-b/-E to one block of input. Newlines are located with memchr,
+ * so the numbering logic runs once per line rather than once per byte.
+ */
+static int transform_block(OutBuf *out, const char *p, size_t n, LineState *st, const CatOptions *opts) {
+    const char *end = p + n;
+
+    while (p < end) {
+        if (st->at_line_start) {
             int should_number = 0;
             if (opts->number_nonblank) {
-                should_number = (c != '\n');
+                should_number = (*p != '\n');
             } else if (opts->number_all_lines) {
                 should_number = 1;
             }
             if (should_number) {
-                
-                fprintf(stdout, "%6lld\t", line_no);
-                line_no++;
+                if (out_line_number(out, st->line_no) != 0) return -1;
+                st->line_no++;
             }
-            at_line_start = 0;
+            st->at_line_start = 0;
         }
 
-        if (opts->show_ends && c == '\n') {
-            fputc('$', stdout);
+        const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        if (!nl) {
+            return out_write(out, p, (size_t)(end - p));
         }
 
-        fputc(c, stdout);
+        if (out_write(out, p, (size_t)(nl - p)) != 0) return -1;
+        if (opts->show_ends && out_putc(out, '$') != 0) return -1;
+        if (out_putc(out, '\n') != 0) return -1;
+        st->at_line_start = 1;
+        p = nl + 1;
+    }
+    return 0;
+}
 
-        if (c == '\n') {
-            at_line_start = 1;
+/*
+ * Counts positions i in [0, n) where p[i] is a newline; with nonblank set,
+ * only those followed by a non-newline (p[n] must then be readable). This is
+ * the number of (non-blank) lines starting in p[1..n].
+ */
+static long long count_line_starts(const char *p, size_t n, int nonblank) {
+    long long count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), nl));
+        if (nonblank && m != 0) {
+            m &= ~(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 1)), nl));
         }
+        count += __builtin_popcount(m);
+    }
+#endif
+    for (; i < n; ++i) {
+        if (p[i] == '\n' && (!nonblank || p[i + 1] != '\n')) count++;
     }
+    return count;
+}
+
+/* Shared state of the parallel numbering mode for one mapped file. */
+typedef struct {
+    const char *map;
+    size_t size;
+    const CatOptions *opts;
+    size_t nchunks;
+    long long *first_line;    /* per chunk: number of its first numbered line */
+    OutBuf *bufs;             /* per worker: formatted output of the round */
+    size_t round_base;        /* first chunk of the current round */
+    int nthreads;
+} ParJob;
+
+typedef struct {
+    ParJob *job;
+    int id;
+    int failed;
+} ParWorker;
+
+static void chunk_bounds(const ParJob *job, size_t c, size_t *start, size_t *end) {
+    *start = c * (size_t)PAR_CHUNK;
+    *end = (c + 1 == job->nchunks) ? job->size : *start + PAR_CHUNK;
+}
+
+static int chunk_at_line_start(const ParJob *job, size_t start) {
+    return start == 0 || job->map[start - 1] == '\n';
+}
+
+/* Pass 1: number of numbered lines that start inside each chunk. */
+static void *par_count(void *arg) {
+    ParWorker *w = (ParWorker*)arg;
+    const ParJob *job = w->job;
+    int nonblank = job->opts->number_nonblank;
+
+    for (size_t c = (size_t)w->id; c < job->nchunks; c += (size_t)job->nthreads) {
+        size_t start, end;
+        chunk_bounds(job, c, &start, &end);
+        long long n = 0;
+        if (chunk_at_line_start(job, start) && (!nonblank || job->map[start] != '\n')) n = 1;
+        n += count_line_starts(job->map + start, end - start - 1, nonblank);
+        job->first_line[c] = n;
+    }
+    return NULL;
+}
+
+/* Pass 2: formats one chunk of the current round into the worker's buffer. */
+static void *par_format(void *arg) {
+    ParWorker *w = (ParWorker*)arg;
+    const ParJob *job = w->job;
+    size_t c = job->round_base + (size_t)w->id;
+    OutBuf *buf = &job->bufs[w->id];
+
+    buf->len = 0;
+    if (c >= job->nchunks) return NULL;
+
+    size_t start, end;
+    chunk_bounds(job, c, &start, &end);
+    LineState st = { job->first_line[c], chunk_at_line_start(job, start) };
+    if (transform_block(buf, job->map + start, end - start, &st, job->opts) != 0) {
+        w->failed = 1;
+    }
+    return NULL;
+}
+
+static int par_run(ParJob *job, ParWorker *workers, void *(*fn)(void*)) {
+    pthread_t *tids = (pthread_t*)calloc((size_t)job->nthreads, sizeof(pthread_t));
+    int *started = (int*)calloc((size_t)job->nthreads, sizeof(int));
+    if (!tids || !started) {
+        free(tids);
+        free(started);
+        return -1;
+    }
+    for (int t = 0; t < job->nthreads; ++t) {
+        workers[t].failed = 0;
+        started[t] = (pthread_create(&tids[t], NULL, fn, &workers[t]) == 0);
+        if (!started[t]) fn(&workers[t]);
+    }
+    int rc = 0;
+    for (int t = 0; t < job->nthreads; ++t) {
+        if (started[t]) pthread_join(tids[t], NULL);
+        if (workers[t].failed) rc = -1;
+    }
+    free(tids);
+    free(started);
+    return rc;
+}
+
+static int should_parallel(const struct stat *in_st, const CatOptions *opts) {
+    return opts->jobs > 1 && needs_transform(opts) && opts->use_mmap != 0 &&
+           S_ISREG(in_st->st_mode) && in_st->st_size > PAR_CHUNK;
+}
+
+/*
+ * Multi-threaded -n/-b/-E for a mapped regular file: the file is split into
+ * PAR_CHUNK slices, the numbered lines of every slice are counted in
+ * parallel and prefix-summed into starting line numbers, then slices are
+ * formatted in parallel rounds and written in order. The output is identical
+ * to the serial path. Returns 1 if the file could not be mapped, -1 on
+ * error, 0 on success with *st set as if the serial path had run.
+ */
+static int parallel_process(int fd, off_t size, const CatOptions *opts, OutBuf *out, LineState *st) {
+    if (lseek(fd, 0, SEEK_CUR) != 0) return 1;
+
+    char *map = (char*)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 1;
+    madvise(map, (size_t)size, MADV_SEQUENTIAL);
+
+    ParJob job;
+    job.map = map;
+    job.size = (size_t)size;
+    job.opts = opts;
+    job.nchunks = (job.size + PAR_CHUNK - 1) / PAR_CHUNK;
+    job.nthreads = opts->jobs;
+    job.round_base = 0;
+    job.first_line = (long long*)calloc(job.nchunks, sizeof(long long));
+    job.bufs = (OutBuf*)calloc((size_t)job.nthreads, sizeof(OutBuf));
+    ParWorker *workers = (ParWorker*)calloc((size_t)job.nthreads, sizeof(ParWorker));
+
+    int rc = (job.first_line && job.bufs && workers) ? 0 : -1;
+    for (int t = 0; rc == 0 && t < job.nthreads; ++t) {
+        workers[t].job = &job;
+        workers[t].id = t;
+        job.bufs[t].fd = -1;
+    }
+
+    if (rc == 0) rc = par_run(&job, workers, par_count);
+
+    long long next_line = 1;
+    for (size_t c = 0; rc == 0 && c < job.nchunks; ++c) {
+        long long n = job.first_line[c];
+        job.first_line[c] = next_line;
+        next_line += n;
+    }
+
+    for (; rc == 0 && job.round_base < job.nchunks; job.round_base += (size_t)job.nthreads) {
+        rc = par_run(&job, workers, par_format);
+        for (int t = 0; rc == 0 && t < job.nthreads; ++t) {
+            rc = write_all(out->fd, job.bufs[t].data, job.bufs[t].len);
+        }
+        size_t done = job.round_base * PAR_CHUNK;
+        size_t len = (size_t)job.nthreads * PAR_CHUNK;
+        if (done + len > job.size) len = job.size - done;
+        madvise(map + done, len, MADV_DONTNEED);
+    }
+
+    if (rc == 0) {
+        st->line_no = next_line;
+        st->at_line_start = (map[job.size - 1] == '\n');
+        lseek(fd, size, SEEK_SET);
+    }
+
+    if (job.bufs) {
+        for (int t = 0; t < job.nthreads; ++t) free(job.bufs[t].data);
+    }
+    free(job.bufs);
+    free(job.first_line);
+    free(workers);
+    munmap(map, (size_t)size);
+    return rc;
+}
+
+/* Errors after which the next, more generic copy method should be tried. */
+static int zero_copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+           err == EBADF || err == ESPIPE || err == ETXTBSY;
+}
+
+/*
+ * Moves data from in_fd to out->fd without passing it through user space:
+ * copy_file_range between regular files, sendfile from a regular file and
+ * splice when either side is a pipe. Returns 0 when the input was drained or
+ * the kernel refused (the caller then finishes with read/write, which also
+ * covers files like /proc entries that report a zero size), -1 on error.
+ */
+static int zero_copy(int in_fd, const struct stat *in_st, OutBuf *out) {
+    int in_reg = S_ISREG(in_st->st_mode);
+    int in_pipe = S_ISFIFO(in_st->st_mode);
+    int out_reg = S_ISREG(out->fd_type);
+    int out_pipe = S_ISFIFO(out->fd_type);
+    if (!out_reg && !out_pipe) return 0;
+
+    int use_cfr = in_reg && out_reg && in_st->st_size > 0;
+    int use_sendfile = in_reg && in_st->st_size > 0;
+    int use_splice = in_pipe || out_pipe;
+
+    while (use_cfr || use_sendfile || use_splice) {
+        ssize_t n;
+        if (use_cfr) {
+            n = copy_file_range(in_fd, NULL, out->fd, NULL, ZERO_COPY_CHUNK, 0);
+        } else if (use_sendfile) {
+            n = sendfile(out->fd, in_fd, NULL, ZERO_COPY_CHUNK);
+        } else {
+            n = splice(in_fd, NULL, out->fd, NULL, ZERO_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        }
+
+        if (n > 0) continue;
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (!zero_copy_unsupported(errno)) return -1;
+
+        /* Fall back to the next method; file offsets stay consistent. */
+        if (use_cfr) use_cfr = 0;
+        else if (use_sendfile) use_sendfile = 0;
+        else use_splice = 0;
+    }
+    return 0;
+}
+
+/*
+ * Decides whether a file is read through mmap. Plain copies to a pipe or
+ * regular file are left to zero_copy() unless --mmap was given explicitly.
+ */
+static int should_mmap(const struct stat *in_st, const CatOptions *opts, const OutBuf *out) {
+    if (opts->use_mmap == 0 || !S_ISREG(in_st->st_mode) || in_st->st_size == 0) return 0;
+    if (opts->use_mmap == 1) return 1;
+    if (in_st->st_size < MMAP_MIN_SIZE) return 0;
+    return needs_transform(opts) || !(S_ISREG(out->fd_type) || S_ISFIFO(out->fd_type));
+}
+
+/*
+ * Processes a regular file straight from a read-only mapping, prefetching
+ * the next window with MADV_WILLNEED and dropping consumed pages so the
+ * resident set stays bounded. Only used when the file offset is 0. On
+ * success the offset is moved to the mapped size so that the caller's read
+ * loop picks up anything appended meanwhile. Returns 1 if mmap could not be
+ * used, -1 on write error.
+ */
+static int mmap_process(int fd, off_t size, const CatOptions *opts, OutBuf *out, LineState *st) {
+    if (lseek(fd, 0, SEEK_CUR) != 0) return 1;
+
+    char *map = (char*)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 1;
+    madvise(map, (size_t)size, MADV_SEQUENTIAL);
+
+    int transform = needs_transform(opts);
+    int rc = 0;
+    for (off_t off = 0; off < size && rc == 0; off += MMAP_WINDOW) {
+        size_t len = (size_t)(size - off < MMAP_WINDOW ? size - off : MMAP_WINDOW);
+        off_t next = off + (off_t)len;
+        if (next < size) {
+            size_t next_len = (size_t)(size - next < MMAP_WINDOW ? size - next : MMAP_WINDOW);
+            madvise(map + next, next_len, MADV_WILLNEED);
+        }
+
+        rc = transform ? transform_block(out, map + off, len, st, opts)
+                       : write_all(out->fd, map + off, len);
+        if (rc == 0 && transform) rc = out_flush(out);
+        madvise(map + off, len, MADV_DONTNEED);
+    }
+
+    munmap(map, (size_t)size);
+    if (rc != 0) return -1;
+    lseek(fd, size, SEEK_SET);
+    return 0;
+}
+
+/*
+ * --index applies to named files only: the sidecar of standard input would
+ * be "./-.lidx", which belongs to a file actually called "-".
+ */
+static int index_wanted(int fd, const CatOptions *opts) {
+    return opts->use_index && fd != STDIN_FILENO;
+}
 
-    if (ferror(fp)) {
+/*
+ * --from=N on a regular file: moves fd to the start of line N, through the
+ * index with --index, and numbers lines as if the ones before were
+ * written. Returns 0, or -1 with errno set.
+ */
+static int seek_to_line(int fd, const char *name, const CatOptions *opts, LineState *st) {
+    LineIndex *idx = index_wanted(fd, opts) ? lineindex_open(fd, name) : NULL;
+    off_t off;
+    uint64_t nonblank;
+    int rc = lineindex_seek(idx, fd, (uint64_t)(opts->from_line - 1), &off, &nonblank);
+    lineindex_free(idx);
+    if (rc != 0 || lseek(fd, off, SEEK_SET) < 0) return -1;
+    st->line_no = opts->number_nonblank ? (long long)nonblank + 1 : opts->from_line;
+    return 0;
+}
+
+static int process_fd(int fd, const char *name, const CatOptions *opts, OutBuf *out) {
+    static char in_buf[IO_BUF_SIZE];
+    int transform = needs_transform(opts);
+    LineState st = { 1, 1 };
+
+    struct stat in_st;
+    int have_stat = (fstat(fd, &in_st) == 0);
+    int mapped = 0;
+
+    /* Compressed input is decoded on a thread; head holds what was read to tell. */
+    unsigned char head[DECOMPRESS_MAGIC_MAX];
+    size_t head_len = 0;
+    int format = decompress_detect(fd, head, &head_len);
+    if (format < 0) {
+        out_flush(out);
         fprintf(stderr, "mycat: error reading '%s': %s\n", name, strerror(errno));
+        return 1;
+    }
+    Decoder *dec = NULL;
+    if (format != DECOMPRESS_NONE) {
+        dec = decoder_start(fd, format, head, head_len);
+        if (!dec) {
+            out_flush(out);
+            fprintf(stderr, "mycat: cannot decompress '%s': %s\n", name, strerror(errno));
+            return 1;
+        }
+        head_len = 0;
+        have_stat = 0;          /* sizes and offsets are those of the compressed file */
+    }
+
+    /* Lines still to be skipped by reading, for --from=N on pipes. */
+    uint64_t skip_left = opts->from_line > 1 ? (uint64_t)(opts->from_line - 1) : 0;
+    uint64_t skipped_nonblank = 0;
+    if (skip_left > 0 && have_stat && S_ISREG(in_st.st_mode)) {
+        if (seek_to_line(fd, name, opts, &st) != 0) {
+            fprintf(stderr, "mycat: error reading '%s': %s\n", name, strerror(errno));
+            return 1;
+        }
+        skip_left = 0;
+    } else if (index_wanted(fd, opts) && have_stat && S_ISREG(in_st.st_mode)) {
+        LineIndex *idx = lineindex_open(fd, name);
+        if (!idx) {
+            fprintf(stderr, "mycat: cannot index '%s': %s\n", name, strerror(errno));
+        }
+        lineindex_free(idx);
+    }
+
+    if (have_stat && should_parallel(&in_st, opts)) {
+        int rc = parallel_process(fd, in_st.st_size, opts, out, &st);
+        if (rc < 0) {
+            fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+            return 1;
+        }
+        mapped = (rc == 0);
+    }
+
+    if (!mapped && have_stat && should_mmap(&in_st, opts, out)) {
+        int rc = mmap_process(fd, in_st.st_size, opts, out, &st);
+        if (rc < 0) {
+            fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+            return 1;
+        }
+        mapped = (rc == 0);
+    }
+
+    if (!mapped && !transform && skip_left == 0 && have_stat) {
+        if (head_len > 0 && write_all(out->fd, (const char*)head, head_len) != 0) {
+            fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+            return 1;
+        }
+        head_len = 0;
+        if (zero_copy(fd, &in_st, out) != 0) {
+            fprintf(stderr, "mycat: error copying '%s': %s\n", name, strerror(errno));
+            return 1;
+        }
+    }
+
+    int status = 0;
+    for (;;) {
+        const char *p = in_buf;
+        ssize_t n;
+        if (dec) {
+            n = decoder_next(dec, &p);
+        } else {
+            /* Bytes read to tell the format come first. */
+            memcpy(in_buf, head, head_len);
+            n = read(fd, in_buf + head_len, sizeof(in_buf) - head_len);
+            if (n >= 0) n += (ssize_t)head_len;
+        }
+        if (n < 0) {
+            if (!dec && errno == EINTR) continue;
+            out_flush(out);
+            fprintf(stderr, "mycat: error reading '%s': %s\n", name,
+                    dec ? decoder_error(dec) : strerror(errno));
+            status = 1;
+            break;
+        }
+        head_len = 0;
+        if (n == 0) break;
+
+        size_t len = (size_t)n;
+        if (skip_left > 0) {
+            size_t used = lineindex_skip_lines(p, len, &skip_left, &skipped_nonblank, &st.at_line_start);
+            if (skip_left > 0) continue;
+            st.line_no = opts->number_nonblank ? (long long)skipped_nonblank + 1 : opts->from_line;
+            p += used;
+            len -= used;
+        }
+
+        int rc = transform ? transform_block(out, p, len, &st, opts)
+                           : write_all(out->fd, p, len);
+        if (rc != 0) {
+            fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+            status = 1;
+            break;
+        }
+    }
+    decoder_close(dec);
+    if (status != 0) return status;
+
+    if (out_flush(out) != 0) {
+        fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* One file argument as prepared by a prefetch worker. */
+typedef struct {
+    int fd;               /* descriptor handed to the main thread, or -1 */
+    int open_errno;       /* open() failed */
+    int read_errno;       /* reading the small file failed */
+    char *data;           /* whole contents of a small regular file */
+    size_t len;
+    int complete;         /* data holds the whole file, fd already closed */
+    int ready;
+} PrefetchSlot;
+
+/*
+ * Many-file mode: workers open and read files ahead of the output into a
+ * bounded ring of slots while the main thread writes them in argument order.
+ */
+typedef struct {
+    char **paths;
+    size_t npaths;
+    PrefetchSlot *slots;
+    size_t nslots;
+    size_t next;          /* next argument to be claimed by a worker */
+    size_t consumed;      /* arguments already written by the main thread */
+    pthread_mutex_t mu;
+    pthread_cond_t can_claim;
+    pthread_cond_t slot_ready;
+} Prefetcher;
+
+static void prefetch_file(const char *path, PrefetchSlot *slot) {
+    slot->fd = -1;
+    if (strcmp(path, "-") == 0) return;   /* stdin is read by the main thread */
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        slot->open_errno = errno;
+        return;
+    }
+
+    struct stat st;
+    int have_stat = (fstat(fd, &st) == 0);
+    if (!have_stat || !S_ISREG(st.st_mode) || st.st_size > PREFETCH_MAX_SIZE) {
+        if (have_stat && S_ISREG(st.st_mode)) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+        slot->fd = fd;
+        return;
+    }
+
+    /* One spare byte tells whether the file grew since fstat. */
+    size_t cap = (size_t)st.st_size + 1;
+    slot->data = (char*)malloc(cap);
+    if (!slot->data) {
+        slot->fd = fd;
+        return;
+    }
+    while (slot->len < cap) {
+        ssize_t n = read(fd, slot->data + slot->len, cap - slot->len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            slot->read_errno = errno;
+            break;
+        }
+        if (n == 0) break;
+        slot->len += (size_t)n;
+    }
+
+    if (slot->read_errno == 0 && (slot->len == cap || decompress_format(slot->data, slot->len) > 0)) {
+        /* Larger than expected or compressed: let the main thread stream it from the start. */
+        free(slot->data);
+        slot->data = NULL;
+        slot->len = 0;
+        if (lseek(fd, 0, SEEK_SET) == 0) {
+            slot->fd = fd;
+            return;
+        }
+        slot->read_errno = errno;
+    }
+    close(fd);
+    slot->complete = 1;
+}
+
+static void *prefetch_worker(void *arg) {
+    Prefetcher *pf = (Prefetcher*)arg;
+
+    pthread_mutex_lock(&pf->mu);
+    for (;;) {
+        while (pf->next < pf->npaths && pf->next >= pf->consumed + pf->nslots) {
+            pthread_cond_wait(&pf->can_claim, &pf->mu);
+        }
+        if (pf->next >= pf->npaths) break;
+        size_t idx = pf->next++;
+        pthread_mutex_unlock(&pf->mu);
+
+        PrefetchSlot slot;
+        memset(&slot, 0, sizeof(slot));
+        prefetch_file(pf->paths[idx], &slot);
+        slot.ready = 1;
+
+        pthread_mutex_lock(&pf->mu);
+        pf->slots[idx % pf->nslots] = slot;
+        pthread_cond_broadcast(&pf->slot_ready);
+    }
+    pthread_mutex_unlock(&pf->mu);
+    return NULL;
+}
+
+/*
+ * Writes the prefetched files in order. Small files are formatted from the
+ * worker's buffer and coalesced into the output buffer, so thousands of tiny
+ * inputs cost a handful of write() calls; other files go through process_fd
+ * as usual. Error messages and the exit code match the serial loop.
+ */
+static int process_prefetched(char **paths, size_t npaths, const CatOptions *opts, OutBuf *out) {
+    Prefetcher pf;
+    memset(&pf, 0, sizeof(pf));
+    pf.paths = paths;
+    pf.npaths = npaths;
+    pf.nslots = (size_t)opts->jobs * PREFETCH_SLOTS_PER_JOB;
+    pf.slots = (PrefetchSlot*)calloc(pf.nslots, sizeof(PrefetchSlot));
+    pthread_t *tids = (pthread_t*)calloc((size_t)opts->jobs, sizeof(pthread_t));
+    if (!pf.slots || !tids) {
+        free(pf.slots);
+        free(tids);
+        return -1;
+    }
+    pthread_mutex_init(&pf.mu, NULL);
+    pthread_cond_init(&pf.can_claim, NULL);
+    pthread_cond_init(&pf.slot_ready, NULL);
+
+    int nstarted = 0;
+    for (int t = 0; t < opts->jobs; ++t) {
+        if (pthread_create(&tids[nstarted], NULL, prefetch_worker, &pf) == 0) nstarted++;
+    }
+    if (nstarted == 0) {
+        pthread_mutex_destroy(&pf.mu);
+        pthread_cond_destroy(&pf.can_claim);
+        pthread_cond_destroy(&pf.slot_ready);
+        free(pf.slots);
+        free(tids);
+        return -1;
+    }
+
+    int exit_code = 0;
+    int transform = needs_transform(opts);
+    for (size_t idx = 0; idx < npaths; ++idx) {
+        PrefetchSlot *slot = &pf.slots[idx % pf.nslots];
+        pthread_mutex_lock(&pf.mu);
+        while (!slot->ready) pthread_cond_wait(&pf.slot_ready, &pf.mu);
+        pthread_mutex_unlock(&pf.mu);
+
+        const char *path = paths[idx];
+        int rc = 0;
+        if (strcmp(path, "-") == 0) {
+            if (out_flush(out) != 0) {
+                fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+                rc = 1;
+            } else {
+                rc = process_fd(STDIN_FILENO, "-", opts, out);
+            }
+        } else if (slot->open_errno != 0) {
+            out_flush(out);
+            fprintf(stderr, "mycat: cannot open '%s': %s\n", path, strerror(slot->open_errno));
+            rc = 1;
+        } else if (slot->complete) {
+            LineState st = { 1, 1 };
+            int wrc = transform ? transform_block(out, slot->data, slot->len, &st, opts)
+                                : out_write(out, slot->data, slot->len);
+            if (wrc != 0) {
+                fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+                rc = 1;
+            } else if (slot->read_errno != 0) {
+                out_flush(out);
+                fprintf(stderr, "mycat: error reading '%s': %s\n", path, strerror(slot->read_errno));
+                rc = 1;
+            }
+        } else {
+            if (out_flush(out) != 0) {
+                fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
+                rc = 1;
+            } else {
+                rc = process_fd(slot->fd, path, opts, out);
+            }
+            close(slot->fd);
+        }
+        if (rc != 0) exit_code = rc;
+
+        free(slot->data);
+        pthread_mutex_lock(&pf.mu);
+        memset(slot, 0, sizeof(*slot));
+        pf.consumed++;
+        pthread_cond_broadcast(&pf.can_claim);
+        pthread_mutex_unlock(&pf.mu);
+    }
+
+    if (out_flush(out) != 0) {
+        fprintf(stderr, "mycat: write error: %s\n", strerror(errno));
         exit_code = 1;
     }
 
+    for (int t = 0; t < nstarted; ++t) pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&pf.mu);
+    pthread_cond_destroy(&pf.can_claim);
+    pthread_cond_destroy(&pf.slot_ready);
+    free(pf.slots);
+    free(tids);
     return exit_code;
 }
 
 int main(int argc, char **argv) {
     CatOptions opts;
     memset(&opts, 0, sizeof(opts));
+    opts.use_mmap = -1;
+    opts.jobs = 1;
+    opts.from_line = 1;
 
     int i = 1;
     int end_of_options = 0;
@@ -67,6 +829,30 @@ int main(int argc, char **argv) {
             end_of_options = 1;
             continue;
         }
+        if (!end_of_options && strcmp(arg, "--mmap") == 0) {
+            opts.use_mmap = 1;
+            continue;
+        }
+        if (!end_of_options && strcmp(arg, "--no-mmap") == 0) {
+            opts.use_mmap = 0;
+            continue;
+        }
+        if (!end_of_options && strcmp(arg, "--index") == 0) {
+            opts.use_index = 1;
+            continue;
+        }
+        if (!end_of_options && strncmp(arg, "--from=", 7) == 0) {
+            char *endp = NULL;
+            errno = 0;
+            long long n = strtoll(arg + 7, &endp, 10);
+            if (arg[7] == '\0' || *endp != '\0' || errno != 0 || n < 1) {
+                fprintf(stderr, "mycat: invalid line number: '%s'\n", arg + 7);
+                print_usage(argv[0]);
+                return 2;
+            }
+            opts.from_line = n;
+            continue;
+        }
         if (!end_of_options && arg[0] == '-' && arg[1] != '\0') {
             for (int j = 1; arg[j] != '\0'; ++j) {
                 char f = arg[j];
@@ -76,6 +862,17 @@ int main(int argc, char **argv) {
                     opts.number_nonblank = 1;
                 } else if (f == 'E') {
                     opts.show_ends = 1;
+                } else if (f == 'j') {
+                    const char *val = arg[j + 1] != '\0' ? arg + j + 1 : (i + 1 < argc ? argv[++i] : NULL);
+                    char *endp = NULL;
+                    long n = val ? strtol(val, &endp, 10) : 0;
+                    if (!val || *endp != '\0' || n < 1 || n > 1024) {
+                        fprintf(stderr, "mycat: invalid number of jobs: '%s'\n", val ? val : "");
+                        print_usage(argv[0]);
+                        return 2;
+                    }
+                    opts.jobs = (int)n;
+                    break;
                 } else {
                     fprintf(stderr, "mycat: unknown option -- %c\n", f);
                     print_usage(argv[0]);
@@ -83,44 +880,57 @@ int main(int argc, char **argv) {
                 }
             }
         } else {
-            break; 
+            break;
         }
     }
 
-    
+
     if (opts.number_nonblank) {
         opts.number_all_lines = 0;
     }
 
+    OutBuf out = { NULL, 0, 0, STDOUT_FILENO, 0 };
+    struct stat out_st;
+    if (fstat(STDOUT_FILENO, &out_st) == 0) {
+        out.fd_type = out_st.st_mode & S_IFMT;
+    }
     int exit_code = 0;
 
     if (i >= argc) {
-        int rc = process_stream(stdin, "-", &opts);
+        int rc = process_fd(STDIN_FILENO, "-", &opts, &out);
         if (rc != 0) exit_code = rc;
+        free(out.data);
         return exit_code;
     }
 
+    if (opts.jobs > 1 && argc - i > 1 && opts.from_line == 1 && !opts.use_index) {
+        int rc = process_prefetched(argv + i, (size_t)(argc - i), &opts, &out);
+        if (rc >= 0) {
+            free(out.data);
+            return rc;
+        }
+    }
+
     for (; i < argc; ++i) {
         const char *path = argv[i];
         if (strcmp(path, "-") == 0) {
-            int rc = process_stream(stdin, "-", &opts);
+            int rc = process_fd(STDIN_FILENO, "-", &opts, &out);
             if (rc != 0) exit_code = rc;
             continue;
         }
 
-        FILE *fp = fopen(path, "rb");
-        if (!fp) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
             fprintf(stderr, "mycat: cannot open '%s': %s\n", path, strerror(errno));
             exit_code = 1;
             continue;
         }
 
-        int rc = process_stream(fp, path, &opts);
+        int rc = process_fd(fd, path, &opts, &out);
         if (rc != 0) exit_code = rc;
-        fclose(fp);
+        close(fd);
     }
 
+    free(out.data);
     return exit_code;
 }
-
-
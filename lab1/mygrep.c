@@ -1,128 +1,1905 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdatomic.h>
+
+#include "decompress.h"
+#include "ere.h"
+#include "lineindex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Initial size of the read buffer; it grows to hold longer lines. */
+#define READ_BUF_SIZE (256 * 1024)
+/* Largest dense Aho-Corasick table (states x byte classes) that is built. */
+#define AC_DENSE_MAX (16 * 1024 * 1024)
+/* -j: regular files larger than this are split into chunks of this size. */
+#define GREP_CHUNK (8 * 1024 * 1024)
+/* --index: larger pattern sets are searched without it. */
+#define INDEX_MAX_PATTERNS 256
+/* -j: how many tasks workers may run ahead of the output, per worker. */
+#define TASKS_AHEAD_PER_JOB 4
 
 static void print_usage(const char *progname) {
-    fprintf(stderr, "Usage: %s PATTERN [FILE ...]\n", progname);
+    fprintf(stderr, "Usage: %s [OPTION ...] PATTERN [FILE ...]\n", progname);
+    fprintf(stderr, "       %s [OPTION ...] -e PATTERN ... [-f PATFILE] ... [FILE ...]\n", progname);
+    fprintf(stderr, "Options: [-Ercl] [-m N] [-A N] [-B N] [-C N] [-j N] [--index]\n");
+    fprintf(stderr, "With -r: [--include=GLOB] [--exclude=GLOB] [--exclude-dir=GLOB]\n");
 }
 
 typedef struct {
-    const char *pattern;
+    const char **items;
+    size_t n;
+    size_t cap;
+} StrList;
+
+static int strlist_add(StrList *list, const char *s) {
+    if (list->n == list->cap) {
+        size_t new_cap = list->cap ? list->cap * 2 : 8;
+        const char **tmp = (const char**)realloc(list->items, new_cap * sizeof(char*));
+        if (!tmp) return -1;
+        list->items = tmp;
+        list->cap = new_cap;
+    }
+    list->items[list->n++] = s;
+    return 0;
+}
+
+typedef struct AcAutomaton AcAutomaton;
+
+typedef struct {
+    char **patterns;          /* -e, -f and PATTERN, split at newlines */
+    size_t npatterns;
+    size_t patterns_cap;
+    const char *pattern;      /* the pattern when a single one is searched */
+    size_t pattern_len;
+    AcAutomaton *ac;          /* all patterns when there are several */
+    int extended;             /* -E: patterns are extended regular expressions */
+    Ere *re;
+    const char *literal;      /* -E: substring every matching line contains */
+    size_t literal_len;
+    int jobs;                 /* -j N: worker threads */
+    int recursive;            /* -r: search directories recursively */
+    StrList include;          /* -r: only files whose name matches one of these */
+    StrList exclude;          /* -r: skip files whose name matches */
+    StrList exclude_dir;      /* -r: do not descend into matching directories */
+    int count_only;           /* -c: print the number of matching lines per file */
+    int list_files;           /* -l: print the names of files with a match */
+    long long max_count;      /* -m N: stop a file after N matching lines; -1 for no limit */
+    long long before;         /* -B N: lines of context before each match */
+    long long after;          /* -A N: lines of context after each match */
+    int context;              /* -A, -B or -C given: context lines and "--" separators are printed */
+    int use_index;            /* --index: skip blocks of FILE using FILE.lidx */
 } GrepOptions;
 
-static int line_matches(const char *line, const char *pattern) {
-    return strstr(line, pattern) != NULL;
+/* Output of a search: written to fp when set, otherwise kept in memory. */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    FILE *fp;
+    int failed;               /* an allocation failed and output was lost */
+} OutBuf;
+
+/*
+ * Everything one thread needs to search: its own DFA cache for -E, the read
+ * buffer and the scratch line, and where matches and errors go.
+ */
+typedef struct {
+    const GrepOptions *opts;
+    EreDfa *dfa;
+    const char *name;         /* file being searched */
+    int print_filename_prefix;
+    int skip_binary;          /* treat files with a NUL in the first block as non-matching */
+    int binary;               /* the last search_fd skipped a binary file */
+    long long limit;          /* matching lines after which a file is done, or -1 */
+    long long count;          /* matching lines found by the current search_fd */
+    atomic_int *cancel;       /* -l -j: set once any chunk of the file has matched */
+    off_t buf_off;            /* file offset of buffer[0] */
+    size_t hist;              /* buffer[hist..] holds lines before the region being searched */
+    off_t printed_upto;       /* file offset just past the last printed line, or -1 */
+    long long after_left;     /* lines still owed as after-context */
+    int draining;             /* -m reached: only the trailing context is left */
+    int context_sep;          /* a context group was printed, so the next one needs "--" */
+    char *buffer;
+    size_t buffer_size;
+    char *scratch;
+    size_t scratch_size;
+    OutBuf out;
+    OutBuf err;
+} Searcher;
+
+/*
+ * Substring search over a whole buffer. Returns the first occurrence of
+ * pat in hay[0..n) or NULL. The SIMD variants compare the first and last
+ * pattern byte against 16/32 candidate positions at once and only run
+ * memcmp where both agree.
+ */
+typedef const char *(*FindFn)(const char *hay, size_t n, const char *pat, size_t m);
+
+static const char *find_scalar(const char *hay, size_t n, const char *pat, size_t m) {
+    return (const char*)memmem(hay, n, pat, m);
+}
+
+#ifdef HAVE_X86_SIMD
+static const char *find_sse2(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m < 2) return find_scalar(hay, n, pat, m);
+
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(hay + i, n - i, pat, m);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m < 2) return find_scalar(hay, n, pat, m);
+
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+        while (mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(hay + i, n - i, pat, m);
+}
+#endif
+
+static FindFn select_find(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_avx2;
+    return find_sse2;
+#else
+    return find_scalar;
+#endif
+}
+
+static FindFn find_fn;
+
+/*
+ * Aho-Corasick automaton for -e/-f pattern sets. Bytes that occur in no
+ * pattern share class 0, so tables have one column per distinct pattern
+ * byte. States are numbered breadth-first and stored as a sorted CSR edge
+ * list plus fail links. The shallowest states, where matching spends most
+ * of its time, also get complete DFA rows, as many as fit AC_DENSE_MAX
+ * entries; deeper states follow edges and fail links.
+ */
+struct AcAutomaton {
+    unsigned char cls[256];
+    unsigned char root_moves[256];  /* byte leaves the root state */
+    int nclasses;
+    int nstates;
+    int ndense;               /* states [0, ndense) have a row in delta */
+    int *edge_start;          /* nstates + 1 offsets into edge_cls/edge_to */
+    unsigned char *edge_cls;
+    int *edge_to;
+    int *fail;
+    unsigned char *out;       /* a pattern ends here or at a fail-link ancestor */
+    int *delta;               /* ndense * nclasses */
+};
+
+static int ac_goto(const AcAutomaton *ac, int s, unsigned char c) {
+    int lo = ac->edge_start[s], hi = ac->edge_start[s + 1];
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ac->edge_cls[mid] == c) return ac->edge_to[mid];
+        if (ac->edge_cls[mid] < c) lo = mid + 1; else hi = mid;
+    }
+    return -1;
+}
+
+/* Fail links always lead to shallower, i.e. lower-numbered, states. */
+static int ac_next(const AcAutomaton *ac, int s, unsigned char c) {
+    while (s >= ac->ndense) {
+        int t = ac_goto(ac, s, c);
+        if (t >= 0) return t;
+        s = ac->fail[s];
+    }
+    return ac->delta[(size_t)s * (size_t)ac->nclasses + c];
+}
+
+static void ac_free(AcAutomaton *ac) {
+    if (!ac) return;
+    free(ac->edge_start);
+    free(ac->edge_cls);
+    free(ac->edge_to);
+    free(ac->fail);
+    free(ac->out);
+    free(ac->delta);
+    free(ac);
+}
+
+static AcAutomaton *ac_build(char **patterns, size_t npatterns) {
+    AcAutomaton *ac = (AcAutomaton*)calloc(1, sizeof(AcAutomaton));
+    if (!ac) return NULL;
+
+    int used[256] = {0};
+    size_t total = 1;
+    for (size_t i = 0; i < npatterns; ++i) {
+        for (const unsigned char *q = (const unsigned char*)patterns[i]; *q; ++q) used[*q] = 1;
+        total += strlen(patterns[i]);
+    }
+    ac->nclasses = 1;
+    for (int b = 0; b < 256; ++b) {
+        if (used[b]) ac->cls[b] = (unsigned char)ac->nclasses++;
+    }
+    if (total > (size_t)0x7fffffff) {
+        ac_free(ac);
+        return NULL;
+    }
+
+    /* Trie as first-child / next-sibling lists while inserting. */
+    int *first_child = (int*)malloc(total * sizeof(int));
+    int *next_sibling = (int*)malloc(total * sizeof(int));
+    unsigned char *label = (unsigned char*)malloc(total);
+    unsigned char *terminal = (unsigned char*)calloc(total, 1);
+    int ok = first_child && next_sibling && label && terminal;
+    int nstates = 1;
+    if (ok) first_child[0] = -1;
+
+    for (size_t i = 0; ok && i < npatterns; ++i) {
+        int s = 0;
+        for (const unsigned char *q = (const unsigned char*)patterns[i]; *q; ++q) {
+            unsigned char c = ac->cls[*q];
+            int t = first_child[s];
+            while (t >= 0 && label[t] != c) t = next_sibling[t];
+            if (t < 0) {
+                t = nstates++;
+                label[t] = c;
+                first_child[t] = -1;
+                next_sibling[t] = first_child[s];
+                first_child[s] = t;
+            }
+            s = t;
+        }
+        terminal[s] = 1;
+    }
+    ac->nstates = nstates;
+
+    /* Renumber breadth-first and flatten to CSR, edges sorted by class. */
+    int *order = ok ? (int*)malloc((size_t)nstates * sizeof(int)) : NULL;
+    int *new_id = ok ? (int*)malloc((size_t)nstates * sizeof(int)) : NULL;
+    ac->edge_start = ok ? (int*)malloc(((size_t)nstates + 1) * sizeof(int)) : NULL;
+    ac->edge_cls = ok ? (unsigned char*)malloc((size_t)nstates) : NULL;
+    ac->edge_to = ok ? (int*)malloc((size_t)nstates * sizeof(int)) : NULL;
+    ac->fail = ok ? (int*)calloc((size_t)nstates, sizeof(int)) : NULL;
+    ac->out = ok ? (unsigned char*)calloc((size_t)nstates, 1) : NULL;
+    ok = ok && order && new_id && ac->edge_start && ac->edge_cls && ac->edge_to && ac->fail && ac->out;
+    if (ok) {
+        int tail = 0;
+        order[tail++] = 0;
+        new_id[0] = 0;
+        for (int head = 0; head < tail; ++head) {
+            for (int t = first_child[order[head]]; t >= 0; t = next_sibling[t]) {
+                new_id[t] = tail;
+                order[tail++] = t;
+            }
+        }
+
+        int e = 0;
+        for (int s = 0; s < nstates; ++s) {
+            int old = order[s];
+            ac->edge_start[s] = e;
+            ac->out[s] = terminal[old];
+            for (int t = first_child[old]; t >= 0; t = next_sibling[t]) {
+                int k = e++;
+                while (k > ac->edge_start[s] && ac->edge_cls[k - 1] > label[t]) {
+                    ac->edge_cls[k] = ac->edge_cls[k - 1];
+                    ac->edge_to[k] = ac->edge_to[k - 1];
+                    k--;
+                }
+                ac->edge_cls[k] = label[t];
+                ac->edge_to[k] = new_id[t];
+            }
+        }
+        ac->edge_start[nstates] = e;
+    }
+    free(first_child);
+    free(next_sibling);
+    free(label);
+    free(terminal);
+    free(order);
+    free(new_id);
+
+    int nc = ac->nclasses;
+    ac->ndense = AC_DENSE_MAX / nc;
+    if (ac->ndense > nstates) ac->ndense = nstates;
+    if (ac->ndense < 1) ac->ndense = 1;
+    ac->delta = ok ? (int*)malloc((size_t)ac->ndense * (size_t)nc * sizeof(int)) : NULL;
+    ok = ok && ac->delta;
+
+    /* States in breadth-first order: fail links, inherited outputs, dense rows. */
+    for (int s = 0; ok && s < nstates; ++s) {
+        for (int k = ac->edge_start[s]; k < ac->edge_start[s + 1]; ++k) {
+            int t = ac->edge_to[k];
+            int f = (s == 0) ? 0 : ac_next(ac, ac->fail[s], ac->edge_cls[k]);
+            ac->fail[t] = f;
+            ac->out[t] |= ac->out[f];
+        }
+        if (s < ac->ndense) {
+            int *row = ac->delta + (size_t)s * (size_t)nc;
+            for (int c = 0; c < nc; ++c) row[c] = (s == 0) ? 0 : ac_next(ac, ac->fail[s], (unsigned char)c);
+            for (int k = ac->edge_start[s]; k < ac->edge_start[s + 1]; ++k) {
+                row[ac->edge_cls[k]] = ac->edge_to[k];
+            }
+        }
+    }
+
+    if (!ok) {
+        ac_free(ac);
+        return NULL;
+    }
+    for (int b = 0; b < 256; ++b) ac->root_moves[b] = (ac->delta[ac->cls[b]] != 0);
+    return ac;
+}
+
+/*
+ * Returns a pointer to the last byte of the first pattern occurrence in
+ * p[0..n), or NULL. No pattern contains '\n', so the automaton falls back to
+ * the root at every newline and a match never spans two lines.
+ */
+static const char *ac_find(const AcAutomaton *ac, const char *p, size_t n) {
+    const unsigned char *q = (const unsigned char*)p;
+    const int *delta = ac->delta;
+    const int nc = ac->nclasses;
+    int s = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (s == 0) {
+            /* Bytes that start no pattern keep the automaton at the root. */
+            while (i < n && !ac->root_moves[q[i]]) i++;
+            if (i == n) break;
+        }
+        unsigned char c = ac->cls[q[i]];
+        s = (s < ac->ndense) ? delta[s * nc + c] : ac_next(ac, s, c);
+        if (ac->out[s]) return p + i;
+    }
+    return NULL;
 }
 
-static int process_stream(FILE *fp, const char *name, const GrepOptions *opts, int print_filename_prefix) {
-    char *buffer = NULL;
-    size_t buffer_size = 0;
-    size_t len = 0;
-    int c;
+/*
+ * -E: lines containing the required literal are found with the substring
+ * search and only those are run through the DFA.
+ */
+static const char *regex_find(Searcher *sr, const char *p, size_t n) {
+    const GrepOptions *opts = sr->opts;
+    if (opts->literal_len == 0) return ere_find(sr->dfa, p, n);
+
+    const char *end = p + n;
+    while (p < end) {
+        const char *hit = find_fn(p, (size_t)(end - p), opts->literal, opts->literal_len);
+        if (!hit) return NULL;
+        const char *line_start = (const char*)memrchr(p, '\n', (size_t)(hit - p));
+        line_start = line_start ? line_start + 1 : p;
+        const char *line_end = (const char*)memchr(hit, '\n', (size_t)(end - hit));
+        if (!line_end) line_end = end;
+
+        const char *m = ere_find(sr->dfa, line_start, (size_t)(line_end - line_start));
+        if (m) return m;
+        p = line_end + 1;
+    }
+    return NULL;
+}
+
+/* Any byte of the first line in p[0..n) that contains a match, or NULL. */
+static const char *find_match(Searcher *sr, const char *p, size_t n) {
+    const GrepOptions *opts = sr->opts;
+    if (sr->dfa) return regex_find(sr, p, n);
+    if (opts->ac) return ac_find(opts->ac, p, n);
+    if (!opts->pattern) return NULL;
+    return find_fn(p, n, opts->pattern, opts->pattern_len);
+}
+
+/* Adds the newline-separated patterns in text[0..len). */
+static int add_patterns(GrepOptions *opts, const char *text, size_t len) {
+    const char *end = text + len;
+    for (;;) {
+        const char *nl = (const char*)memchr(text, '\n', (size_t)(end - text));
+        const char *stop = nl ? nl : end;
+        if (opts->npatterns == opts->patterns_cap) {
+            size_t new_cap = opts->patterns_cap ? opts->patterns_cap * 2 : 16;
+            char **tmp = (char**)realloc(opts->patterns, new_cap * sizeof(char*));
+            if (!tmp) return -1;
+            opts->patterns = tmp;
+            opts->patterns_cap = new_cap;
+        }
+        char *pat = strndup(text, (size_t)(stop - text));
+        if (!pat) return -1;
+        opts->patterns[opts->npatterns++] = pat;
+        if (!nl) return 0;
+        text = nl + 1;
+    }
+}
+
+/* -f: one pattern per line; a trailing '\r' is dropped as lines are matched without it. */
+static int add_pattern_file(GrepOptions *opts, const char *path) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "mygrep: cannot open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    int rc = 0;
+    while (rc == 0 && (n = getline(&line, &line_cap, fp)) >= 0) {
+        if (n > 0 && line[n - 1] == '\n') n--;
+        if (n > 0 && line[n - 1] == '\r') n--;
+        if (add_patterns(opts, line, (size_t)n) != 0) {
+            fprintf(stderr, "mygrep: memory allocation failed\n");
+            rc = -1;
+        }
+    }
+    if (rc == 0 && ferror(fp)) {
+        fprintf(stderr, "mygrep: error reading '%s': %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return rc;
+}
+
+/*
+ * Picks the matcher: -E compiles all patterns into one regular expression;
+ * otherwise an empty pattern matches every line, a single pattern uses the
+ * SIMD substring search and larger sets the Aho-Corasick automaton.
+ */
+static int compile_patterns(GrepOptions *opts) {
+    opts->pattern = NULL;
+    opts->pattern_len = 0;
+    opts->ac = NULL;
+    if (opts->extended) {
+        const char *err = NULL;
+        opts->re = ere_compile(opts->patterns, opts->npatterns, &err);
+        if (!opts->re) {
+            fprintf(stderr, "mygrep: %s\n", err);
+            return -1;
+        }
+        opts->literal = ere_required_literal(opts->re, &opts->literal_len);
+        return 0;
+    }
+    for (size_t i = 0; i < opts->npatterns; ++i) {
+        if (opts->patterns[i][0] == '\0') {
+            opts->pattern = "";
+            return 0;
+        }
+    }
+    if (opts->npatterns == 1) {
+        opts->pattern = opts->patterns[0];
+        opts->pattern_len = strlen(opts->pattern);
+    } else if (opts->npatterns > 1) {
+        opts->ac = ac_build(opts->patterns, opts->npatterns);
+        if (!opts->ac) {
+            fprintf(stderr, "mygrep: memory allocation failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_patterns(GrepOptions *opts) {
+    for (size_t i = 0; i < opts->npatterns; ++i) free(opts->patterns[i]);
+    free(opts->patterns);
+    ac_free(opts->ac);
+    ere_free(opts->re);
+    free(opts->include.items);
+    free(opts->exclude.items);
+    free(opts->exclude_dir.items);
+}
+
+static void out_write(OutBuf *out, const char *p, size_t n) {
+    if (out->fp) {
+        fwrite(p, 1, n, out->fp);
+        return;
+    }
+    if (out->failed) return;
+    if (out->len + n > out->cap) {
+        size_t new_cap = out->cap ? out->cap : 4096;
+        while (new_cap < out->len + n) new_cap *= 2;
+        char *tmp = (char*)realloc(out->data, new_cap);
+        if (!tmp) {
+            out->failed = 1;
+            return;
+        }
+        out->data = tmp;
+        out->cap = new_cap;
+    }
+    memcpy(out->data + out->len, p, n);
+    out->len += n;
+}
+
+static void out_free(OutBuf *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+    out->failed = 0;
+}
+
+/* Error messages follow the matches of the same file when output is kept in memory. */
+static void report_error(Searcher *sr, const char *fmt, ...) {
+    char small[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len < sizeof(small)) {
+        out_write(&sr->err, small, (size_t)len);
+        return;
+    }
+    char *msg = (char*)malloc((size_t)len + 1);
+    if (!msg) {
+        out_write(&sr->err, small, sizeof(small) - 1);
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(msg, (size_t)len + 1, fmt, ap);
+    va_end(ap);
+    out_write(&sr->err, msg, (size_t)len);
+    free(msg);
+}
+
+static int searcher_init(Searcher *sr, const GrepOptions *opts, FILE *out, FILE *err) {
+    memset(sr, 0, sizeof(*sr));
+    sr->opts = opts;
+    sr->limit = opts->list_files ? 1 : opts->max_count;
+    sr->out.fp = out;
+    sr->err.fp = err;
+    sr->buffer_size = READ_BUF_SIZE;
+    sr->buffer = (char*)malloc(sr->buffer_size);
+    if (!sr->buffer) return -1;
+    if (opts->re) {
+        sr->dfa = ere_dfa_new(opts->re);
+        if (!sr->dfa) return -1;
+    }
+    return 0;
+}
+
+static void searcher_free(Searcher *sr) {
+    free(sr->buffer);
+    free(sr->scratch);
+    ere_dfa_free(sr->dfa);
+    out_free(&sr->out);
+    out_free(&sr->err);
+}
+
+/*
+ * Prints one line with the '\r' characters dropped, as lines are matched
+ * without them. sep follows the name: ':' for matches, '-' for context.
+ */
+static void print_line(Searcher *sr, const char *p, size_t len, char sep) {
+    if (sr->print_filename_prefix) {
+        out_write(&sr->out, sr->name, strlen(sr->name));
+        out_write(&sr->out, &sep, 1);
+    }
+    const char *end = p + len;
+    const char *cr;
+    while ((cr = (const char*)memchr(p, '\r', (size_t)(end - p))) != NULL) {
+        out_write(&sr->out, p, (size_t)(cr - p));
+        p = cr + 1;
+    }
+    out_write(&sr->out, p, (size_t)(end - p));
+    out_write(&sr->out, "\n", 1);
+}
+
+/*
+ * Context mode: prints a line, starting a new group with "--" unless it
+ * directly follows the last printed line.
+ */
+static void print_in_group(Searcher *sr, const char *p, size_t len, char sep) {
+    off_t off = sr->buf_off + (off_t)(p - sr->buffer);
+    if (sr->printed_upto >= 0 ? off > sr->printed_upto : sr->context_sep) {
+        out_write(&sr->out, "--\n", 3);
+    }
+    print_line(sr, p, len, sep);
+    sr->printed_upto = off + (off_t)len + 1;
+    sr->context_sep = 1;
+}
+
+/*
+ * Walks back from the line starting at p over up to opts->before earlier
+ * lines, stopping at what was already printed or is no longer buffered.
+ */
+static const char *context_start(const Searcher *sr, const char *p) {
+    const char *floor = sr->buffer + sr->hist;
+    if (sr->printed_upto > sr->buf_off + (off_t)sr->hist) {
+        floor = sr->buffer + (sr->printed_upto - sr->buf_off);
+    }
+    for (long long k = 0; k < sr->opts->before && p > floor; ++k) {
+        const char *nl = (const char*)memrchr(floor, '\n', (size_t)(p - 1 - floor));
+        p = nl ? nl + 1 : floor;
+    }
+    return p;
+}
+
+/*
+ * Records a matching line and prints it, with its before-context, unless
+ * only counts or names are wanted. Returns 1 once the file needs no more
+ * searching; when -m is reached with after-context still owed, switches to
+ * draining instead.
+ */
+static int emit_match(Searcher *sr, const char *p, size_t len) {
+    const GrepOptions *opts = sr->opts;
+    if (opts->context) {
+        for (const char *q = context_start(sr, p); q < p;) {
+            const char *nl = (const char*)memchr(q, '\n', (size_t)(p - q));
+            print_in_group(sr, q, (size_t)(nl - q), '-');
+            q = nl + 1;
+        }
+        print_in_group(sr, p, len, ':');
+        sr->after_left = opts->after;
+    } else if (!opts->count_only && !opts->list_files) {
+        print_line(sr, p, len, ':');
+    }
+    sr->count++;
+    if (sr->limit < 0 || sr->count < sr->limit) return 0;
+    if (sr->after_left == 0) return 1;
+    sr->draining = 1;
+    return 0;
+}
+
+/* A line that did not match: printed if after-context is owed. Returns 1 once draining is over. */
+static int emit_other(Searcher *sr, const char *p, size_t len) {
+    if (sr->after_left > 0) {
+        print_in_group(sr, p, len, '-');
+        sr->after_left--;
+    }
+    return sr->draining && sr->after_left == 0;
+}
+
+/* -c and -l: one line per file once all of it has been searched. */
+static void report_file(const GrepOptions *opts, OutBuf *out, const char *name,
+                        int print_filename_prefix, long long count) {
+    if (opts->list_files) {
+        if (count > 0) {
+            out_write(out, name, strlen(name));
+            out_write(out, "\n", 1);
+        }
+    } else if (opts->count_only) {
+        char num[32];
+        int len = snprintf(num, sizeof(num), "%lld\n", count);
+        if (print_filename_prefix) {
+            out_write(out, name, strlen(name));
+            out_write(out, ":", 1);
+        }
+        out_write(out, num, (size_t)len);
+    }
+}
+
+/*
+ * Lines are matched with '\r' removed. For a substring search a '\r'
+ * followed only by more '\r's up to the end of its line cannot change the
+ * result, anything else can. A regular expression can see any '\r' (as
+ * "$" or "."), so there every one counts.
+ */
+static int has_inner_cr(const Searcher *sr, const char *p, size_t n) {
+    if (sr->opts->re) return memchr(p, '\r', n) != NULL;
+    const char *end = p + n;
+    const char *cr;
+    while ((cr = (const char*)memchr(p, '\r', (size_t)(end - p))) != NULL) {
+        if (cr + 1 < end && cr[1] != '\n' && cr[1] != '\r') return 1;
+        p = cr + 1;
+    }
+    return 0;
+}
+
+/*
+ * Slow path for regions where '\r' matters: matches each line after removing
+ * them. Returns 1 if a line matched, 0 if not, -1 on allocation failure;
+ * sets *stop when the file is done.
+ */
+static int search_lines_stripped(Searcher *sr, const char *p, size_t n, int *stop) {
+    const char *end = p + n;
     int matched_any = 0;
 
-    while (1) {
-        c = fgetc(fp);
-        if (c == EOF) {
-            if (len > 0) {
-                buffer[len] = '\0';
-                if (line_matches(buffer, opts->pattern)) {
-                    if (print_filename_prefix) {
-                        fprintf(stdout, "%s:", name);
-                    }
-                    fputs(buffer, stdout);
-                    fputc('\n', stdout);
-                    matched_any = 1;
+    while (p < end) {
+        const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = nl ? nl : end;
+        size_t len = (size_t)(line_end - p);
+
+        if (sr->draining) {
+            if (emit_other(sr, p, len)) {
+                *stop = 1;
+                break;
+            }
+            p = line_end + 1;
+            continue;
+        }
+        if (len > sr->scratch_size) {
+            char *tmp = (char*)realloc(sr->scratch, len);
+            if (!tmp) return -1;
+            sr->scratch = tmp;
+            sr->scratch_size = len;
+        }
+        size_t k = 0;
+        for (const char *q = p; q < line_end; ++q) {
+            if (*q != '\r') sr->scratch[k++] = *q;
+        }
+        if (find_match(sr, sr->scratch, k)) {
+            matched_any = 1;
+            if (emit_match(sr, p, len)) {
+                *stop = 1;
+                break;
+            }
+        } else if (emit_other(sr, p, len)) {
+            *stop = 1;
+            break;
+        }
+        p = line_end + 1;
+    }
+    return matched_any;
+}
+
+/*
+ * Searches a region made of whole lines (the last one may lack its '\n').
+ * The pattern is looked for across the whole region first; line boundaries
+ * are only located around a hit, so non-matching lines are never touched
+ * individually. Returns 1 if a line matched, 0 if not, -1 on allocation
+ * failure; sets *stop when the file is done.
+ */
+static int search_region(Searcher *sr, const char *p, size_t n, int *stop) {
+    if (has_inner_cr(sr, p, n)) {
+        return search_lines_stripped(sr, p, n, stop);
+    }
+
+    const char *end = p + n;
+    int matched_any = 0;
+
+    while (p < end) {
+        if (sr->after_left > 0 || sr->draining) {
+            /* Lines owed as after-context are taken one at a time. */
+            const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+            const char *line_end = nl ? nl : end;
+            size_t len = (size_t)(line_end - p);
+            if (!sr->draining && find_match(sr, p, len)) {
+                matched_any = 1;
+                if (emit_match(sr, p, len)) {
+                    *stop = 1;
+                    break;
                 }
-                len = 0;
+            } else if (emit_other(sr, p, len)) {
+                *stop = 1;
+                break;
             }
+            p = line_end + 1;
+            continue;
+        }
+
+        const char *hit = find_match(sr, p, (size_t)(end - p));
+        if (!hit) break;
+
+        const char *line_start = (const char*)memrchr(p, '\n', (size_t)(hit - p));
+        line_start = line_start ? line_start + 1 : p;
+        const char *line_end = (const char*)memchr(hit, '\n', (size_t)(end - hit));
+        if (!line_end) line_end = end;
+
+        matched_any = 1;
+        if (emit_match(sr, line_start, (size_t)(line_end - line_start))) {
+            *stop = 1;
             break;
         }
+        p = line_end + 1;
+    }
+    return matched_any;
+}
+
+/*
+ * Searches fd to EOF when limit < 0. Otherwise only the lines that start in
+ * [start, limit) are searched, read with pread: a chunk that does not begin
+ * the file starts one byte early and skips through the first '\n', and the
+ * line running across limit is finished, so neighbouring chunks meet on the
+ * same line boundary. Reading stops early once sr->limit lines matched or
+ * another chunk cancelled the file. The matching lines are counted in
+ * sr->count. A whole file that starts with a compressed format's magic is
+ * searched decompressed. Returns 0 if a line matched, 1 if not, 2 on error.
+ */
+static int search_fd(Searcher *sr, int fd, off_t start, off_t limit) {
+    int ranged = (limit >= 0);
+    int skip_partial = ranged && start > 0;
+    off_t pos = skip_partial ? start - 1 : start;   /* offset of the next pread */
+    off_t base = pos;                               /* file offset of buffer[0] */
+    size_t bstart = 0, end = 0;
+    int eof = 0;
+    int done = 0;
+    int probed = !sr->skip_binary;
+    int sniffed = ranged;
+    Decoder *dec = NULL;
+    int matched_any = 0;
+    int rc = 0;
+
+    sr->count = 0;
+    sr->binary = 0;
+    sr->buf_off = base;
+    sr->hist = 0;
+    sr->printed_upto = -1;
+    sr->after_left = 0;
+    sr->draining = 0;
+    if (sr->limit == 0) return 1;
+
+    while (!eof && !done) {
+        if (sr->cancel && atomic_load_explicit(sr->cancel, memory_order_relaxed)) break;
 
-        if (len + 1 >= buffer_size) {
-            size_t new_size = buffer_size == 0 ? 256 : buffer_size * 2;
-            char *new_buf = (char*)realloc(buffer, new_size);
+        /* Keep the unfinished last line and refill the rest of the buffer. */
+        if (bstart > 0) {
+            /* -B: the last lines before bstart stay for a match right after the refill. */
+            size_t keep = sr->opts->context ? (size_t)(context_start(sr, sr->buffer + bstart) - sr->buffer)
+                                            : bstart;
+            memmove(sr->buffer, sr->buffer + keep, end - keep);
+            end -= keep;
+            bstart -= keep;
+            base += (off_t)keep;
+            sr->buf_off = base;
+            sr->hist = 0;
+        }
+        if (end == sr->buffer_size) {
+            char *new_buf = (char*)realloc(sr->buffer, sr->buffer_size * 2);
             if (!new_buf) {
-                fprintf(stderr, "mygrep: memory allocation failed\n");
-                free(buffer);
-                return 2;
+                report_error(sr, "mygrep: memory allocation failed\n");
+                rc = 2;
+                break;
+            }
+            sr->buffer = new_buf;
+            sr->buffer_size *= 2;
+        }
+
+        ssize_t n = ranged ? pread(fd, sr->buffer + end, sr->buffer_size - end, pos)
+                  : dec    ? decoder_read(dec, sr->buffer + end, sr->buffer_size - end)
+                           : read(fd, sr->buffer + end, sr->buffer_size - end);
+        if (n < 0) {
+            if (!dec && errno == EINTR) continue;
+            report_error(sr, "mygrep: error reading '%s': %s\n", sr->name,
+                         dec ? decoder_error(dec) : strerror(errno));
+            rc = 2;
+            break;
+        }
+        if (n == 0) {
+            eof = 1;
+        }
+        end += (size_t)n;
+        pos += n;
+
+        /* Compressed input: what was read so far is handed to the decoder. */
+        if (!sniffed) {
+            int format = decompress_format(sr->buffer, end);
+            if (format < 0 && !eof) continue;
+            sniffed = 1;
+            if (format > 0) {
+                dec = decoder_start(fd, format, sr->buffer, end);
+                if (!dec) {
+                    report_error(sr, "mygrep: cannot decompress '%s': %s\n", sr->name, strerror(errno));
+                    rc = 2;
+                    break;
+                }
+                end = 0;
+                eof = 0;
+                continue;
+            }
+        }
+
+        if (!probed) {
+            probed = 1;
+            if (memchr(sr->buffer, '\0', end) != NULL) {
+                sr->binary = 1;
+                break;
+            }
+        }
+
+        if (skip_partial) {
+            const char *nl = (const char*)memchr(sr->buffer, '\n', end);
+            if (!nl) {
+                bstart = end;
+                continue;
+            }
+            bstart = (size_t)(nl + 1 - sr->buffer);
+            sr->hist = bstart;
+            skip_partial = 0;
+        }
+
+        /* Search complete lines only; at EOF the last line may lack '\n'. */
+        size_t region_end;
+        if (eof) {
+            region_end = end;
+            /* A trailing line made only of '\r' is empty once stripped: no line at all. */
+            const char *last_nl = (const char*)memrchr(sr->buffer + bstart, '\n', end - bstart);
+            size_t tail = last_nl ? (size_t)(last_nl + 1 - sr->buffer) : bstart;
+            size_t k = tail;
+            while (k < end && sr->buffer[k] == '\r') k++;
+            if (k == end) region_end = tail;
+        } else {
+            const char *last_nl = (const char*)memrchr(sr->buffer + bstart, '\n', end - bstart);
+            if (!last_nl) continue;
+            region_end = (size_t)(last_nl + 1 - sr->buffer);
+        }
+
+        /* Stop after the line that contains the byte before limit. */
+        if (ranged && base + (off_t)region_end > limit) {
+            done = 1;
+            if (base + (off_t)bstart >= limit) {
+                region_end = bstart;
+            } else {
+                size_t k = (size_t)(limit - 1 - base);
+                const char *nl = (const char*)memchr(sr->buffer + k, '\n', region_end - k);
+                if (nl) region_end = (size_t)(nl + 1 - sr->buffer);
+            }
+        }
+
+        if (region_end > bstart) {
+            int stop = 0;
+            int m = search_region(sr, sr->buffer + bstart, region_end - bstart, &stop);
+            if (stop) {
+                done = 1;
+                if (sr->cancel) atomic_store(sr->cancel, 1);
+            }
+            if (m < 0) {
+                report_error(sr, "mygrep: memory allocation failed\n");
+                rc = 2;
+                break;
             }
-            buffer = new_buf;
-            buffer_size = new_size;
+            if (m) matched_any = 1;
+        }
+        bstart = region_end;
+    }
+
+    decoder_close(dec);
+    if (rc == 0 && sr->out.failed) {
+        report_error(sr, "mygrep: memory allocation failed\n");
+        rc = 2;
+    }
+    if (rc != 0) return rc;
+    return matched_any ? 0 : 1;
+}
+
+/* Whether fd, a regular file, holds compressed data. */
+static int is_compressed(int fd) {
+    unsigned char head[DECOMPRESS_MAGIC_MAX];
+    size_t n;
+    return decompress_detect(fd, head, &n) > 0;
+}
+
+/*
+ * --index needs a literal of at least a trigram that every match
+ * contains. Context lines would need the skipped lines as well.
+ */
+static int index_usable(const GrepOptions *opts) {
+    if (!opts->use_index || opts->context) return 0;
+    if (opts->re) return opts->literal_len >= 3;
+    if (opts->ac) {
+        if (opts->npatterns > INDEX_MAX_PATTERNS) return 0;
+        for (size_t i = 0; i < opts->npatterns; ++i) {
+            if (strlen(opts->patterns[i]) < 3) return 0;
         }
+        return 1;
+    }
+    return opts->pattern && opts->pattern_len >= 3;
+}
+
+static int block_may_match(const GrepOptions *opts, const LineIndex *idx, uint64_t b) {
+    if (opts->re) return lineindex_block_may_contain(idx, b, opts->literal, opts->literal_len);
+    if (opts->ac) {
+        for (size_t i = 0; i < opts->npatterns; ++i) {
+            if (lineindex_block_may_contain(idx, b, opts->patterns[i], strlen(opts->patterns[i]))) return 1;
+        }
+        return 0;
+    }
+    return lineindex_block_may_contain(idx, b, opts->pattern, opts->pattern_len);
+}
+
+/*
+ * --index: searches only the runs of blocks that may hold a match. A run
+ * covers the lines that start between the line holding its first byte and
+ * its end, so a line is searched if any block it touches may match, and
+ * never twice. -c counts and -m limits carry across runs. Returns -1 when
+ * there is no usable index, and the caller then searches the whole file.
+ */
+static int search_indexed(Searcher *sr, int fd, const char *path) {
+    struct stat st;
+    if (!index_usable(sr->opts) || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || is_compressed(fd)) return -1;
+    LineIndex *idx = lineindex_open(fd, path);
+    if (!idx) return -1;
+
+    uint64_t nblocks = lineindex_nblocks(idx);
+    off_t size = (off_t)lineindex_file_size(idx);
+    long long limit = sr->limit, total = 0;
+    off_t searched = 0;       /* lines starting before this were searched */
+    int rc = 1;
 
-        if (c == '\r') {
+    for (uint64_t b = 0; b < nblocks && rc != 2;) {
+        if (!block_may_match(sr->opts, idx, b)) {
+            b++;
             continue;
         }
+        uint64_t e = b + 1;
+        while (e < nblocks && block_may_match(sr->opts, idx, e)) e++;
+
+        off_t start = lineindex_block_line_start(idx, b);
+        if (start < searched) start = searched;
+        off_t end = e < nblocks ? (off_t)e * LINEINDEX_BLOCK : size;
+        int r = search_fd(sr, fd, start, end);
+        total += sr->count;
+        if (r != 1) rc = r;
+        searched = end;
+        b = e;
+        if (limit >= 0) {
+            if (total >= limit) break;
+            sr->limit = limit - total;
+        }
+    }
+
+    sr->limit = limit;
+    sr->count = total;
+    lineindex_free(idx);
+    return rc;
+}
+
+/* Searches an open file: through its index with --index, otherwise whole. */
+static int search_file(Searcher *sr, int fd, const char *path) {
+    int rc = search_indexed(sr, fd, path);
+    return rc >= 0 ? rc : search_fd(sr, fd, 0, -1);
+}
+
+/* -j: a file, or a newline-aligned byte range of a large one. */
+typedef struct {
+    const char *path;
+    off_t start;
+    off_t limit;              /* -1: the whole file */
+    size_t file_first;        /* index of the first task of its file */
+    int first;                /* first task of its file */
+    int last;                 /* last task of its file */
+    int done;
+    int rc;
+    int opened;
+    long long count;          /* matching lines in this range */
+    atomic_int matched;       /* first task only: -l found the file's answer */
+    OutBuf out;
+    OutBuf err;
+} GrepTask;
+
+/*
+ * Workers claim tasks in argument order, at most `window` ahead of the main
+ * thread, which writes each task's buffered output once it is done. stdin
+ * is searched by the main thread when its turn comes.
+ */
+typedef struct {
+    const GrepOptions *opts;
+    GrepTask *tasks;
+    size_t ntasks;
+    size_t next;              /* next task to be claimed by a worker */
+    size_t emitted;           /* tasks already written by the main thread */
+    size_t window;
+    int print_filename_prefix;
+    pthread_mutex_t mu;
+    pthread_cond_t can_claim;
+    pthread_cond_t task_done;
+} GrepPool;
+
+static void run_task(Searcher *sr, GrepTask *tasks, GrepTask *task) {
+    sr->name = task->path;
+    sr->context_sep = 0;
+    sr->cancel = sr->opts->list_files ? &tasks[task->file_first].matched : NULL;
+    int fd = open(task->path, O_RDONLY);
+    if (fd < 0) {
+        if (task->first) {
+            report_error(sr, "mygrep: cannot open '%s': %s\n", task->path, strerror(errno));
+        }
+        task->rc = 2;
+    } else {
+        task->rc = task->limit < 0 ? search_file(sr, fd, task->path)
+                                   : search_fd(sr, fd, task->start, task->limit);
+        task->opened = 1;
+        task->count = sr->count;
+        close(fd);
+    }
+    task->out = sr->out;
+    task->err = sr->err;
+    memset(&sr->out, 0, sizeof(sr->out));
+    memset(&sr->err, 0, sizeof(sr->err));
+}
+
+static void *grep_worker(void *arg) {
+    GrepPool *pool = (GrepPool*)arg;
+    Searcher sr;
+    int ready = (searcher_init(&sr, pool->opts, NULL, NULL) == 0);
+    sr.print_filename_prefix = pool->print_filename_prefix;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mu);
+        while (pool->next < pool->ntasks &&
+               (pool->next >= pool->emitted + pool->window ||
+                strcmp(pool->tasks[pool->next].path, "-") == 0)) {
+            if (strcmp(pool->tasks[pool->next].path, "-") == 0) {
+                pool->next++;
+                continue;
+            }
+            pthread_cond_wait(&pool->can_claim, &pool->mu);
+        }
+        if (pool->next >= pool->ntasks) {
+            pthread_mutex_unlock(&pool->mu);
+            break;
+        }
+        GrepTask *task = &pool->tasks[pool->next++];
+        pthread_mutex_unlock(&pool->mu);
+
+        if (ready) {
+            run_task(&sr, pool->tasks, task);
+        } else {
+            task->rc = 2;
+            task->err.failed = 1;
+        }
+
+        pthread_mutex_lock(&pool->mu);
+        task->done = 1;
+        pthread_cond_broadcast(&pool->task_done);
+        pthread_mutex_unlock(&pool->mu);
+    }
+    searcher_free(&sr);
+    return NULL;
+}
+
+/*
+ * One task per file, or with split set several for a regular file larger
+ * than GREP_CHUNK that is not compressed.
+ */
+static GrepTask *plan_tasks(char **paths, size_t npaths, int split, size_t *ntasks) {
+    size_t cap = npaths, n = 0;
+    GrepTask *tasks = (GrepTask*)calloc(cap, sizeof(GrepTask));
+    if (!tasks) return NULL;
+
+    for (size_t i = 0; i < npaths; ++i) {
+        struct stat st;
+        off_t size = -1;
+        if (split && strcmp(paths[i], "-") != 0 && stat(paths[i], &st) == 0 &&
+            S_ISREG(st.st_mode) && st.st_size > GREP_CHUNK) {
+            int fd = open(paths[i], O_RDONLY);
+            if (fd >= 0) {
+                if (!is_compressed(fd)) size = st.st_size;
+                close(fd);
+            }
+        }
+        size_t pieces = size < 0 ? 1 : (size_t)((size + GREP_CHUNK - 1) / GREP_CHUNK);
+        if (n + pieces > cap) {
+            size_t new_cap = cap * 2;
+            while (new_cap < n + pieces) new_cap *= 2;
+            GrepTask *tmp = (GrepTask*)realloc(tasks, new_cap * sizeof(GrepTask));
+            if (!tmp) {
+                free(tasks);
+                return NULL;
+            }
+            memset(tmp + cap, 0, (new_cap - cap) * sizeof(GrepTask));
+            tasks = tmp;
+            cap = new_cap;
+        }
+        for (size_t k = 0; k < pieces; ++k) {
+            GrepTask *task = &tasks[n++];
+            task->path = paths[i];
+            task->file_first = n - 1 - k;
+            task->start = size < 0 ? 0 : (off_t)k * GREP_CHUNK;
+            task->limit = size < 0 ? -1 : (k + 1 == pieces ? size : task->start + GREP_CHUNK);
+            task->first = (k == 0);
+            task->last = (k + 1 == pieces);
+        }
+    }
+    *ntasks = n;
+    return tasks;
+}
+
+/*
+ * -j: searches the files concurrently, large ones split into chunks, and
+ * writes the results in argument order. A file's status is 2 if any of its
+ * chunks failed, else 0 if any matched. -m and context lines need a file
+ * searched in order, and --index picks its own ranges, so files are not
+ * split then. A file's context groups are set off from the previous
+ * file's with "--". Returns the exit code, or -1 when there is nothing to
+ * run in parallel or the pool cannot be set up.
+ */
+static int search_parallel(char **paths, size_t npaths, const GrepOptions *opts, int print_filename_prefix) {
+    size_t ntasks = 0;
+    GrepTask *tasks = plan_tasks(paths, npaths, opts->max_count < 0 && !opts->context && !opts->use_index,
+                                 &ntasks);
+    if (!tasks) return -1;
+    if (ntasks < 2) {
+        free(tasks);
+        return -1;
+    }
+
+    GrepPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.opts = opts;
+    pool.tasks = tasks;
+    pool.ntasks = ntasks;
+    pool.window = (size_t)opts->jobs * TASKS_AHEAD_PER_JOB;
+    pool.print_filename_prefix = print_filename_prefix;
+
+    Searcher sr;
+    pthread_t *tids = (pthread_t*)calloc((size_t)opts->jobs, sizeof(pthread_t));
+    if (!tids || searcher_init(&sr, opts, stdout, stderr) != 0) {
+        if (tids) searcher_free(&sr);
+        free(tids);
+        free(tasks);
+        return -1;
+    }
+    sr.print_filename_prefix = print_filename_prefix;
+    pthread_mutex_init(&pool.mu, NULL);
+    pthread_cond_init(&pool.can_claim, NULL);
+    pthread_cond_init(&pool.task_done, NULL);
+
+    int nstarted = 0;
+    for (int t = 0; t < opts->jobs && (size_t)t < ntasks; ++t) {
+        if (pthread_create(&tids[nstarted], NULL, grep_worker, &pool) == 0) nstarted++;
+    }
+    if (nstarted == 0) {
+        pthread_mutex_destroy(&pool.mu);
+        pthread_cond_destroy(&pool.can_claim);
+        pthread_cond_destroy(&pool.task_done);
+        searcher_free(&sr);
+        free(tids);
+        free(tasks);
+        return -1;
+    }
+
+    int exit_code = 0;
+    int file_rc = 1;
+    long long file_count = 0;
+    int printed_any = 0;
+    for (size_t i = 0; i < ntasks; ++i) {
+        GrepTask *task = &tasks[i];
+        if (strcmp(task->path, "-") == 0) {
+            sr.name = "-";
+            sr.context_sep = printed_any;
+            task->rc = search_fd(&sr, STDIN_FILENO, 0, -1);
+            task->opened = 1;
+            task->count = sr.count;
+            printed_any = sr.context_sep;
+        } else {
+            pthread_mutex_lock(&pool.mu);
+            while (!task->done) pthread_cond_wait(&pool.task_done, &pool.mu);
+            pthread_mutex_unlock(&pool.mu);
+
+            if (opts->context && task->out.len > 0) {
+                if (printed_any) fputs("--\n", stdout);
+                printed_any = 1;
+            }
+            fwrite(task->out.data, 1, task->out.len, stdout);
+            if (task->err.len > 0) {
+                fflush(stdout);
+                fwrite(task->err.data, 1, task->err.len, stderr);
+            }
+            if (task->out.failed || task->err.failed) {
+                fprintf(stderr, "mygrep: memory allocation failed\n");
+                task->rc = 2;
+            }
+            out_free(&task->out);
+            out_free(&task->err);
+        }
+
+        pthread_mutex_lock(&pool.mu);
+        pool.emitted++;
+        pthread_cond_broadcast(&pool.can_claim);
+        pthread_mutex_unlock(&pool.mu);
+
+        file_count = task->first ? task->count : file_count + task->count;
+        if (task->last && tasks[task->file_first].opened) {
+            report_file(opts, &sr.out, task->path, print_filename_prefix, file_count);
+        }
+        if (task->first) {
+            file_rc = task->rc;
+        } else if (task->rc == 2 || file_rc == 2) {
+            file_rc = 2;
+        } else if (task->rc == 0) {
+            file_rc = 0;
+        }
+        if (task->last && file_rc != 0) exit_code = file_rc; /* prefer last non-zero */
+    }
+
+    for (int t = 0; t < nstarted; ++t) pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&pool.mu);
+    pthread_cond_destroy(&pool.can_claim);
+    pthread_cond_destroy(&pool.task_done);
+    searcher_free(&sr);
+    free(tids);
+    free(tasks);
+    return exit_code;
+}
+
+/*
+ * -r: an open directory, kept until its queued subdirectories have been
+ * opened relative to it, so that paths are never resolved from the root.
+ */
+typedef struct {
+    DIR *dir;
+    atomic_int refs;
+} DirRef;
+
+typedef struct {
+    char *path;               /* the argument joined with the names below it */
+    size_t name_off;          /* start of the last component in path */
+    DirRef *parent;           /* NULL for command-line arguments */
+    int is_dir;
+} WalkItem;
+
+/* The owner pushes and pops at the back; idle workers steal from the front. */
+typedef struct {
+    WalkItem *items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    pthread_mutex_t mu;
+} WalkDeque;
+
+typedef struct Walker Walker;
+
+typedef struct {
+    Walker *walker;
+    size_t id;
+    Searcher sr;
+    char *path;               /* scratch for the path of the file being searched */
+    size_t path_cap;
+} WalkWorker;
+
+struct Walker {
+    const GrepOptions *opts;
+    WalkDeque *deques;
+    size_t nworkers;
+    atomic_size_t pending;    /* items queued or being processed */
+    atomic_int sleepers;
+    unsigned long wakeups;    /* bumped under mu whenever sleepers should recheck */
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    pthread_mutex_t out_mu;   /* each file's output is written as one piece */
+    int printed_any;          /* context groups need "--" between files */
+    int any_match;
+    int any_error;
+};
+
+static void dirref_release(DirRef *ref) {
+    if (ref && atomic_fetch_sub(&ref->refs, 1) == 1) {
+        closedir(ref->dir);
+        free(ref);
+    }
+}
+
+static int deque_push(WalkDeque *dq, WalkItem item) {
+    int rc = 0;
+    pthread_mutex_lock(&dq->mu);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(WalkItem));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            size_t new_cap = dq->cap ? dq->cap * 2 : 64;
+            WalkItem *tmp = (WalkItem*)realloc(dq->items, new_cap * sizeof(WalkItem));
+            if (tmp) {
+                dq->items = tmp;
+                dq->cap = new_cap;
+            } else {
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0) dq->items[dq->tail++] = item;
+    pthread_mutex_unlock(&dq->mu);
+    return rc;
+}
+
+static int deque_take(WalkDeque *dq, WalkItem *item, int steal) {
+    int found = 0;
+    pthread_mutex_lock(&dq->mu);
+    if (dq->head < dq->tail) {
+        *item = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+        found = 1;
+        if (dq->head == dq->tail) dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->mu);
+    return found;
+}
+
+static void walker_wake(Walker *wk) {
+    pthread_mutex_lock(&wk->mu);
+    wk->wakeups++;
+    pthread_cond_broadcast(&wk->wake);
+    pthread_mutex_unlock(&wk->mu);
+}
 
-        if (c == '\n') {
-            buffer[len] = '\0';
-            if (line_matches(buffer, opts->pattern)) {
-                if (print_filename_prefix) {
-                    fprintf(stdout, "%s:", name);
+static int walker_next(WalkWorker *w, WalkItem *item) {
+    Walker *wk = w->walker;
+    if (deque_take(&wk->deques[w->id], item, 0)) return 1;
+    for (size_t k = 1; k < wk->nworkers; ++k) {
+        if (deque_take(&wk->deques[(w->id + k) % wk->nworkers], item, 1)) return 1;
+    }
+    return 0;
+}
+
+static const char *join_path(char **buf, size_t *cap, const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = (dlen > 0 && dir[dlen - 1] != '/');
+    size_t need = dlen + (size_t)slash + nlen + 1;
+    if (need > *cap) {
+        char *tmp = (char*)realloc(*buf, need);
+        if (!tmp) return NULL;
+        *buf = tmp;
+        *cap = need;
+    }
+    memcpy(*buf, dir, dlen);
+    if (slash) (*buf)[dlen] = '/';
+    memcpy(*buf + dlen + slash, name, nlen + 1);
+    return *buf;
+}
+
+static int glob_any(const StrList *globs, const char *name) {
+    for (size_t i = 0; i < globs->n; ++i) {
+        if (fnmatch(globs->items[i], name, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+static void walk_emit(WalkWorker *w, int rc) {
+    Walker *wk = w->walker;
+    Searcher *sr = &w->sr;
+    pthread_mutex_lock(&wk->out_mu);
+    if (wk->opts->context && sr->out.len > 0) {
+        if (wk->printed_any) fputs("--\n", stdout);
+        wk->printed_any = 1;
+    }
+    fwrite(sr->out.data, 1, sr->out.len, stdout);
+    if (sr->err.len > 0) {
+        fflush(stdout);
+        fwrite(sr->err.data, 1, sr->err.len, stderr);
+    }
+    if (sr->out.failed || sr->err.failed) {
+        fprintf(stderr, "mygrep: memory allocation failed\n");
+        rc = 2;
+    }
+    if (rc == 0) wk->any_match = 1;
+    if (rc == 2) wk->any_error = 1;
+    pthread_mutex_unlock(&wk->out_mu);
+    sr->out.len = sr->err.len = 0;
+    sr->out.failed = sr->err.failed = 0;
+}
+
+/* dir_fd < 0: a command-line argument, opened by its path. */
+static void walk_file(WalkWorker *w, int dir_fd, const char *name, const char *path) {
+    Searcher *sr = &w->sr;
+    sr->name = path;
+    sr->skip_binary = (dir_fd >= 0);
+    sr->context_sep = 0;
+    int rc;
+    int fd = dir_fd >= 0 ? openat(dir_fd, name, O_RDONLY | O_NOCTTY | O_CLOEXEC)
+                         : (strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY));
+    if (fd < 0) {
+        report_error(sr, "mygrep: cannot open '%s': %s\n", path, strerror(errno));
+        rc = 2;
+    } else {
+        rc = search_fd(sr, fd, 0, -1);
+        if (!sr->binary) report_file(sr->opts, &sr->out, path, 1, sr->count);
+        if (fd != STDIN_FILENO) close(fd);
+    }
+    walk_emit(w, rc);
+}
+
+/*
+ * Reads one directory: regular files are searched right away and
+ * subdirectories are queued. Symbolic links found while recursing are not
+ * followed, and other special files are skipped.
+ */
+static void walk_dir(WalkWorker *w, const WalkItem *item) {
+    Walker *wk = w->walker;
+    const GrepOptions *opts = wk->opts;
+    int fd = item->parent
+        ? openat(dirfd(item->parent->dir), item->path + item->name_off,
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+        : open(item->path[0] ? item->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int open_errno = errno;
+    dirref_release(item->parent);
+
+    w->sr.name = item->path;
+    if (fd < 0) {
+        report_error(&w->sr, "mygrep: cannot open '%s': %s\n", item->path, strerror(open_errno));
+        walk_emit(w, 2);
+        return;
+    }
+    DIR *dir = fdopendir(fd);
+    DirRef *ref = dir ? (DirRef*)malloc(sizeof(DirRef)) : NULL;
+    if (!ref) {
+        report_error(&w->sr, "mygrep: cannot open '%s': %s\n", item->path, strerror(dir ? ENOMEM : errno));
+        if (dir) closedir(dir); else close(fd);
+        walk_emit(w, 2);
+        return;
+    }
+    ref->dir = dir;
+    atomic_init(&ref->refs, 1);
+
+    struct dirent *de;
+    errno = 0;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        int is_dir = (de->d_type == DT_DIR);
+        int is_reg = (de->d_type == DT_REG);
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_reg = S_ISREG(st.st_mode);
+            }
+        }
+
+        if (is_reg && (opts->include.n == 0 || glob_any(&opts->include, name)) &&
+            !glob_any(&opts->exclude, name)) {
+            const char *path = join_path(&w->path, &w->path_cap, item->path, name);
+            if (path) {
+                walk_file(w, fd, name, path);
+            } else {
+                w->sr.err.failed = 1;
+                walk_emit(w, 2);
+            }
+        } else if (is_dir && !glob_any(&opts->exclude_dir, name)) {
+            const char *path = join_path(&w->path, &w->path_cap, item->path, name);
+            WalkItem child = { path ? strdup(path) : NULL, 0, ref, 1 };
+            if (child.path) {
+                child.name_off = strlen(child.path) - strlen(name);
+                atomic_fetch_add(&ref->refs, 1);
+                atomic_fetch_add(&wk->pending, 1);
+                if (deque_push(&wk->deques[w->id], child) == 0) {
+                    if (atomic_load(&wk->sleepers) > 0) walker_wake(wk);
+                    continue;
                 }
-                fputs(buffer, stdout);
-                fputc('\n', stdout);
-                matched_any = 1;
+                atomic_fetch_sub(&wk->pending, 1);
+                atomic_fetch_sub(&ref->refs, 1);
+                free(child.path);
+            }
+            w->sr.err.failed = 1;
+            walk_emit(w, 2);
+        }
+        errno = 0;
+    }
+    if (errno != 0) {
+        w->sr.name = item->path;
+        report_error(&w->sr, "mygrep: error reading '%s': %s\n", item->path, strerror(errno));
+        walk_emit(w, 2);
+    }
+    dirref_release(ref);
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *w = (WalkWorker*)arg;
+    Walker *wk = w->walker;
+
+    for (;;) {
+        WalkItem item;
+        int found = walker_next(w, &item);
+        if (!found) {
+            /* Register as a sleeper before the last look, so a push in between wakes us. */
+            pthread_mutex_lock(&wk->mu);
+            unsigned long seen = wk->wakeups;
+            atomic_fetch_add(&wk->sleepers, 1);
+            pthread_mutex_unlock(&wk->mu);
+
+            found = walker_next(w, &item);
+            pthread_mutex_lock(&wk->mu);
+            while (!found && wk->wakeups == seen && atomic_load(&wk->pending) > 0) {
+                pthread_cond_wait(&wk->wake, &wk->mu);
+            }
+            atomic_fetch_sub(&wk->sleepers, 1);
+            pthread_mutex_unlock(&wk->mu);
+            if (!found) {
+                if (atomic_load(&wk->pending) == 0) break;
+                continue;
             }
-            len = 0;
+        }
+
+        if (item.is_dir) {
+            walk_dir(w, &item);
         } else {
-            buffer[len++] = (char)c;
+            walk_file(w, -1, item.path, item.path);
         }
+        free(item.path);
+        if (atomic_fetch_sub(&wk->pending, 1) == 1) walker_wake(wk);
     }
+    return NULL;
+}
 
-    if (ferror(fp)) {
-        fprintf(stderr, "mygrep: error reading '%s': %s\n", name, strerror(errno));
-        free(buffer);
-        return 2;
+/*
+ * -r: walks the arguments with opts->jobs threads, each depth-first on its
+ * own deque and stealing the shallowest directories of the others when
+ * idle. Output comes per file in whatever order files finish, always with
+ * the name prefix. An empty path stands for the current directory.
+ * Returns 2 if any error occurred, else 0 if any line matched, else 1.
+ */
+static int search_recursive(char **paths, size_t npaths, const GrepOptions *opts) {
+    size_t nworkers = (size_t)opts->jobs;
+    Walker wk;
+    memset(&wk, 0, sizeof(wk));
+    wk.opts = opts;
+    wk.nworkers = nworkers;
+    wk.deques = (WalkDeque*)calloc(nworkers, sizeof(WalkDeque));
+    WalkWorker *workers = (WalkWorker*)calloc(nworkers, sizeof(WalkWorker));
+    pthread_t *tids = (pthread_t*)calloc(nworkers, sizeof(pthread_t));
+    int ok = (wk.deques && workers && tids);
+    atomic_init(&wk.pending, 0);
+    atomic_init(&wk.sleepers, 0);
+    pthread_mutex_init(&wk.mu, NULL);
+    pthread_cond_init(&wk.wake, NULL);
+    pthread_mutex_init(&wk.out_mu, NULL);
+
+    for (size_t t = 0; ok && t < nworkers; ++t) pthread_mutex_init(&wk.deques[t].mu, NULL);
+    for (size_t t = 0; ok && t < nworkers; ++t) {
+        workers[t].walker = &wk;
+        workers[t].id = t;
+        if (searcher_init(&workers[t].sr, opts, NULL, NULL) != 0) ok = 0;
+        workers[t].sr.print_filename_prefix = 1;
+    }
+
+    /* Pushed in reverse so that worker 0 pops the first argument first. */
+    for (size_t i = npaths; ok && i-- > 0;) {
+        struct stat st;
+        const char *real = paths[i][0] ? paths[i] : ".";
+        int is_dir = strcmp(real, "-") != 0 && stat(real, &st) == 0 && S_ISDIR(st.st_mode);
+        WalkItem item = { strdup(paths[i]), 0, NULL, is_dir };
+        if (!item.path || deque_push(&wk.deques[0], item) != 0) {
+            free(item.path);
+            ok = 0;
+            break;
+        }
+        atomic_fetch_add(&wk.pending, 1);
+    }
+
+    size_t nstarted = 0;
+    if (ok) {
+        for (size_t t = 0; t < nworkers; ++t) {
+            if (pthread_create(&tids[nstarted], NULL, walk_worker, &workers[t]) == 0) nstarted++;
+        }
+        /* Deques of workers that failed to start are stolen from; with none, walk here. */
+        if (nstarted == 0) walk_worker(&workers[0]);
     }
+    for (size_t t = 0; t < nstarted; ++t) pthread_join(tids[t], NULL);
 
-    free(buffer);
-    return matched_any ? 0 : 1; 
+    if (!ok) fprintf(stderr, "mygrep: memory allocation failed\n");
+    for (size_t t = 0; workers && wk.deques && tids && t < nworkers; ++t) {
+        WalkItem item;
+        while (deque_take(&wk.deques[t], &item, 0)) free(item.path);
+        free(wk.deques[t].items);
+        pthread_mutex_destroy(&wk.deques[t].mu);
+        searcher_free(&workers[t].sr);
+        free(workers[t].path);
+    }
+    pthread_mutex_destroy(&wk.mu);
+    pthread_cond_destroy(&wk.wake);
+    pthread_mutex_destroy(&wk.out_mu);
+    free(wk.deques);
+    free(workers);
+    free(tids);
+
+    if (!ok || wk.any_error) return 2;
+    return wk.any_match ? 0 : 1;
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        print_usage(argv[0]);
+    GrepOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.jobs = 1;
+    opts.max_count = -1;
+    find_fn = select_find();
+
+    int argi = 1;
+    int have_patterns = 0;
+    int context = 0;
+    for (; argi < argc; ++argi) {
+        const char *arg = argv[argi];
+        if (strcmp(arg, "--") == 0) {
+            argi++;
+            break;
+        }
+        if (arg[0] != '-' || arg[1] == '\0') break;
+
+        if (strcmp(arg, "--index") == 0) {
+            opts.use_index = 1;
+            continue;
+        }
+        if (arg[1] == '-') {
+            static const char *const long_opts[] = { "--include=", "--exclude=", "--exclude-dir=" };
+            StrList *lists[] = { &opts.include, &opts.exclude, &opts.exclude_dir };
+            size_t k = 0;
+            while (k < 3 && strncmp(arg, long_opts[k], strlen(long_opts[k])) != 0) k++;
+            if (k == 3) {
+                fprintf(stderr, "mygrep: unrecognized option '%s'\n", arg);
+                print_usage(argv[0]);
+                free_patterns(&opts);
+                return 2;
+            }
+            if (strlist_add(lists[k], arg + strlen(long_opts[k])) != 0) {
+                fprintf(stderr, "mygrep: memory allocation failed\n");
+                free_patterns(&opts);
+                return 2;
+            }
+            continue;
+        }
+
+        for (int j = 1; arg[j] != '\0'; ++j) {
+            char f = arg[j];
+            if (f == 'E') {
+                opts.extended = 1;
+                continue;
+            }
+            if (f == 'r') {
+                opts.recursive = 1;
+                continue;
+            }
+            if (f == 'c') {
+                opts.count_only = 1;
+                continue;
+            }
+            if (f == 'l') {
+                opts.list_files = 1;
+                continue;
+            }
+            if (!strchr("efjmABC", f)) {
+                fprintf(stderr, "mygrep: unknown option -- %c\n", f);
+                print_usage(argv[0]);
+                free_patterns(&opts);
+                return 2;
+            }
+            const char *val = arg[j + 1] != '\0' ? arg + j + 1 : (argi + 1 < argc ? argv[++argi] : NULL);
+            if (f == 'j') {
+                char *endp = NULL;
+                long n = val ? strtol(val, &endp, 10) : 0;
+                if (!val || *endp != '\0' || n < 1 || n > 1024) {
+                    fprintf(stderr, "mygrep: invalid number of jobs: '%s'\n", val ? val : "");
+                    print_usage(argv[0]);
+                    free_patterns(&opts);
+                    return 2;
+                }
+                opts.jobs = (int)n;
+                break;
+            }
+            if (f == 'm' || f == 'A' || f == 'B' || f == 'C') {
+                char *endp = NULL;
+                long long n = val ? strtoll(val, &endp, 10) : 0;
+                if (!val || *val == '\0' || *endp != '\0' || n < 0) {
+                    fprintf(stderr, "mygrep: invalid %s: '%s'\n",
+                            f == 'm' ? "max count" : "context length", val ? val : "");
+                    print_usage(argv[0]);
+                    free_patterns(&opts);
+                    return 2;
+                }
+                if (f == 'm') opts.max_count = n;
+                else context = 1;
+                if (f == 'A' || f == 'C') opts.after = n;
+                if (f == 'B' || f == 'C') opts.before = n;
+                break;
+            }
+            if (!val) {
+                fprintf(stderr, "mygrep: option requires an argument -- %c\n", f);
+                print_usage(argv[0]);
+                free_patterns(&opts);
+                return 2;
+            }
+            int rc = (f == 'e') ? add_patterns(&opts, val, strlen(val)) : add_pattern_file(&opts, val);
+            if (rc != 0) {
+                if (f == 'e') fprintf(stderr, "mygrep: memory allocation failed\n");
+                free_patterns(&opts);
+                return 2;
+            }
+            have_patterns = 1;
+            break;
+        }
+    }
+
+    if (!have_patterns) {
+        if (argi >= argc) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (add_patterns(&opts, argv[argi], strlen(argv[argi])) != 0) {
+            fprintf(stderr, "mygrep: memory allocation failed\n");
+            free_patterns(&opts);
+            return 2;
+        }
+        argi++;
+    }
+    if (compile_patterns(&opts) != 0) {
+        free_patterns(&opts);
         return 2;
     }
+    opts.context = context && !opts.count_only && !opts.list_files;
 
-    GrepOptions opts;
-    opts.pattern = argv[1];
+    if (opts.recursive) {
+        /* No arguments: the current directory, with names printed relative to it. */
+        static char here[] = "";
+        static char *dot_args[] = { here };
+        int rc = argi < argc ? search_recursive(argv + argi, (size_t)(argc - argi), &opts)
+                             : search_recursive(dot_args, 1, &opts);
+        free_patterns(&opts);
+        return rc;
+    }
 
-    int argi = 2;
+    Searcher sr;
+    if (searcher_init(&sr, &opts, stdout, stderr) != 0) {
+        fprintf(stderr, "mygrep: memory allocation failed\n");
+        searcher_free(&sr);
+        free_patterns(&opts);
+        return 2;
+    }
     int exit_code = 0;
 
     if (argi >= argc) {
         /* Read from stdin */
-        int rc = process_stream(stdin, "-", &opts, 0);
+        sr.name = "-";
+        int rc = search_fd(&sr, STDIN_FILENO, 0, -1);
+        report_file(&opts, &sr.out, "-", 0, sr.count);
+        searcher_free(&sr);
+        free_patterns(&opts);
         return rc;
     }
 
     int num_files = argc - argi;
-    int print_filename_prefix = (num_files > 1);
+    sr.print_filename_prefix = (num_files > 1);
+
+    if (opts.jobs > 1) {
+        int rc = search_parallel(argv + argi, (size_t)num_files, &opts, sr.print_filename_prefix);
+        if (rc >= 0) {
+            searcher_free(&sr);
+            free_patterns(&opts);
+            return rc;
+        }
+    }
 
     for (; argi < argc; ++argi) {
         const char *path = argv[argi];
         if (strcmp(path, "-") == 0) {
-            int rc = process_stream(stdin, "-", &opts, print_filename_prefix);
+            sr.name = "-";
+            int rc = search_fd(&sr, STDIN_FILENO, 0, -1);
+            report_file(&opts, &sr.out, "-", sr.print_filename_prefix, sr.count);
             if (rc != 0) exit_code = rc;
             continue;
         }
 
-        FILE *fp = fopen(path, "rb");
-        if (!fp) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
             fprintf(stderr, "mygrep: cannot open '%s': %s\n", path, strerror(errno));
             exit_code = 2;
             continue;
         }
-        int rc = process_stream(fp, path, &opts, print_filename_prefix);
+        sr.name = path;
+        int rc = search_file(&sr, fd, path);
+        report_file(&opts, &sr.out, path, sr.print_filename_prefix, sr.count);
         if (rc != 0) exit_code = rc; /* prefer last non-zero */
-        fclose(fp);
+        close(fd);
     }
 
+    searcher_free(&sr);
+    free_patterns(&opts);
     return exit_code;
 }
-
-
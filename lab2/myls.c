@@ -1,53 +1,384 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <limits.h>
+#include <locale.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+// Буфер одного вызова getdents64
+#define DENTS_BUF_SIZE (1024 * 1024)
+// С этого числа записей stat'ы каталога раздаются потокам
+#define PAR_STAT_MIN 1024
+// Записей, которые поток забирает за раз
+#define STAT_BATCH 64
+// Потоков stat по умолчанию: ждут в основном ответа файловой системы, не CPU
+#define DEFAULT_STAT_JOBS 8
+// С этого числа записей сортировка делится между потоками
+#define PAR_SORT_MIN (64 * 1024)
+// Куски, которые сортировка слиянием сначала сортирует вставками
+#define SORT_RUN 16
+// Вывод уходит write'ом такими кусками
+#define OUT_CHUNK (64 * 1024)
+// Слотов в кэше отформатированных дат (по минутам)
+#define DATE_CACHE_SLOTS 64
+// --du без числа: сколько самых больших каталогов показать
+#define DU_DEFAULT_TOP 20
+// Шардов в множестве (st_dev, st_ino) для --du
+#define INODE_SHARDS 64
+// -R: сколько байт готовых листингов может ждать печати
+#define WALK_BUDGET (64 * 1024 * 1024)
+
 #define COLOR_BLUE "\x1b[34m"
 #define COLOR_GREEN "\x1b[32m"
 #define COLOR_CYAN "\x1b[36m"
 #define COLOR_RESET "\x1b[0m"
 
+// Порядок вывода; из -t, -S, -U действует последний
+enum { SORT_NAME, SORT_TIME, SORT_SIZE, SORT_NONE };
+
+// --json: один JSON-массив, --ndjson: по объекту на строку
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_NDJSON };
+
 typedef struct Options {
-    int showAll;   // -a
-    int longList;  // -l
+    int showAll;     // -a
+    int longList;    // -l
+    int sortBy;      // -t, -S, -U
+    int reverse;     // -r
+    int numericIds;  // -n: uid/gid as numbers, implies -l
+    int color;       // --color: always 1, never 0, auto (terminal only) -1
+    int recursive;   // -R
+    int format;      // --json, --ndjson
+    int zero;        // -0: lines end with '\0'
+    int du;          // --du[=N]: N biggest directories by disk usage, 0 if off
+    int jobs;        // -j N: threads issuing stat calls and, with -R/--du, listing directories
 } Options;
 
 static void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-l] [-a] [paths...]\n", prog);
+    fprintf(stderr, "Usage: %s [-l] [-a] [-n] [-R] [-t|-S|-U] [-r] [-0] [-j N] [--color[=WHEN]] [--json|--ndjson] "
+                    "[--du[=N]] [paths...]\n", prog);
 }
 
+// Компактная запись: имя и цель симлинка лежат в арене Listing, здесь
+// только смещения и нужные поля stat.
 typedef struct EntryInfo {
-    char *name;            // entry name (without path)
-    char *fullPath;        // full path used for stat
-    struct stat st;        // lstat data
-    int isSymlink;         // 1 if S_ISLNK
+    size_t nameOff;        // entry name (without path) in the arena
+    size_t linkOff;        // -l: symlink target in the arena, 0 if none
+    size_t keyOff;         // collation key, see listing_keys
+    uint64_t keyPrefix;    // first 8 bytes of the key, big-endian
+    off_t size;
+    blkcnt_t blocks;
+    time_t mtime;
+    long mtimeNsec;
+    nlink_t nlink;
+    dev_t dev;             // --du: hardlinks are counted once
+    ino_t ino;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;           // only the file type when taken from d_type
+    int statErr;           // errno of a failed stat; the entry is then dropped
 } EntryInfo;
 
-static int compare_entries_alpha(const void *a, const void *b) {
-    const EntryInfo *ea = (const EntryInfo *)a;
-    const EntryInfo *eb = (const EntryInfo *)b;
-    return strcoll(ea->name, eb->name);
+// Bump-арена для строк. Растёт realloc'ом, поэтому записи хранят смещения.
+typedef struct Arena {
+    char *data;
+    size_t len;
+    size_t cap;
+} Arena;
+
+// Содержимое одного каталога; освобождается целиком listing_free
+typedef struct Listing {
+    EntryInfo *entries;
+    size_t len;
+    size_t cap;
+    Arena names;
+    Arena keys;          // strxfrm'ы имён; пусто, если collateBytes
+} Listing;
+
+static int useColor;     // имена раскрашиваются
+static int collateBytes; // LC_COLLATE - C/POSIX: ключ сортировки - само имя
+static char eol = '\n';  // конец строки записи, '\0' с -0 (заголовки - '\n', как в ls --zero)
+
+// Место ещё под n байт. Смещение 0 занято пустой строкой и означает
+// "нет". -1 без памяти.
+static int arena_reserve(Arena *a, size_t n) {
+    size_t need = a->len + (a->len == 0) + n;
+    if (need > a->cap) {
+        size_t newCap = a->cap ? a->cap * 2 : 64 * 1024;
+        while (newCap < need) newCap *= 2;
+        char *tmp = (char *)realloc(a->data, newCap);
+        if (!tmp) return -1;
+        a->data = tmp;
+        a->cap = newCap;
+    }
+    if (a->len == 0) a->data[a->len++] = '\0';
+    return 0;
+}
+
+// Копирует s[0..n) с '\0' в арену; 0 без памяти
+static size_t arena_add(Arena *a, const char *s, size_t n) {
+    if (arena_reserve(a, n + 1) != 0) return 0;
+    size_t off = a->len;
+    memcpy(a->data + off, s, n);
+    a->data[off + n] = '\0';
+    a->len += n + 1;
+    return off;
+}
+
+// strxfrm(s) в арену; 0 без памяти
+static size_t arena_add_xfrm(Arena *a, const char *s, size_t n) {
+    size_t room = 2 * n + 16;
+    for (;;) {
+        if (arena_reserve(a, room) != 0) return 0;
+        size_t off = a->len;
+        size_t k = strxfrm(a->data + off, s, a->cap - off);
+        if (k < a->cap - off) {
+            a->len += k + 1;
+            return off;
+        }
+        room = k + 1;
+    }
+}
+
+static const char *entry_name(const Listing *l, const EntryInfo *e) {
+    return l->names.data + e->nameOff;
+}
+
+// Ключи сравниваются strcmp'ом и дают тот же порядок, что strcoll имён
+static const char *listing_keys(const Listing *l) {
+    return collateBytes ? l->names.data : l->keys.data;
+}
+
+// Новая запись с именем name, остальные поля нулевые; NULL без памяти
+static EntryInfo *listing_add(Listing *l, const char *name, size_t nameLen) {
+    if (l->len == l->cap) {
+        size_t newCap = l->cap ? l->cap * 2 : 256;
+        EntryInfo *tmp = (EntryInfo *)realloc(l->entries, newCap * sizeof(EntryInfo));
+        if (!tmp) return NULL;
+        l->entries = tmp;
+        l->cap = newCap;
+    }
+    size_t off = arena_add(&l->names, name, nameLen);
+    if (!off) return NULL;
+    EntryInfo *e = &l->entries[l->len++];
+    memset(e, 0, sizeof(*e));
+    e->nameOff = off;
+    return e;
+}
+
+static void listing_free(Listing *l) {
+    free(l->entries);
+    free(l->names.data);
+    free(l->keys.data);
+    memset(l, 0, sizeof(*l));
+}
+
+static void entry_set_stat(EntryInfo *e, const struct stat *st) {
+    e->size = st->st_size;
+    e->blocks = st->st_blocks;
+    e->mtime = st->st_mtim.tv_sec;
+    e->mtimeNsec = st->st_mtim.tv_nsec;
+    e->nlink = st->st_nlink;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->mode = st->st_mode;
+}
+
+typedef struct SortCtx {
+    const char *keys;
+    int by;
+    int reverse;
+} SortCtx;
+
+// Ключи считаются один раз на запись, а не strcoll на каждое сравнение.
+// Первые 8 байт ключа лежат в самой записи, и большинство сравнений
+// до строк не доходит.
+static int listing_make_keys(Listing *l) {
+    for (size_t i = 0; i < l->len; ++i) {
+        EntryInfo *e = &l->entries[i];
+        const char *name = entry_name(l, e);
+        if (collateBytes) {
+            e->keyOff = e->nameOff;
+        } else {
+            e->keyOff = arena_add_xfrm(&l->keys, name, strlen(name));
+            if (!e->keyOff) return -1;
+        }
+    }
+    const char *keys = listing_keys(l);
+    for (size_t i = 0; i < l->len; ++i) {
+        const unsigned char *k = (const unsigned char *)keys + l->entries[i].keyOff;
+        uint64_t p = 0;
+        int end = 0;
+        for (int j = 0; j < 8; ++j) {
+            if (!end && k[j] == '\0') end = 1;
+            p = (p << 8) | (end ? 0 : k[j]);
+        }
+        l->entries[i].keyPrefix = p;
+    }
+    return 0;
+}
+
+static int compare_entries(const EntryInfo *a, const EntryInfo *b, const SortCtx *c) {
+    int r = 0;
+    if (c->by == SORT_TIME) {
+        if (a->mtime != b->mtime) r = a->mtime > b->mtime ? -1 : 1;
+        else if (a->mtimeNsec != b->mtimeNsec) r = a->mtimeNsec > b->mtimeNsec ? -1 : 1;
+    } else if (c->by == SORT_SIZE) {
+        if (a->size != b->size) r = a->size > b->size ? -1 : 1;
+    }
+    if (r == 0) {
+        if (a->keyPrefix != b->keyPrefix) r = a->keyPrefix < b->keyPrefix ? -1 : 1;
+        else r = strcmp(c->keys + a->keyOff, c->keys + b->keyOff);
+    }
+    return c->reverse ? -r : r;
+}
+
+// src[lo..mid) и src[mid..hi) -> dst[lo..hi); при равенстве левая первой
+static void merge_runs(const EntryInfo *src, EntryInfo *dst, size_t lo, size_t mid, size_t hi,
+                       const SortCtx *c) {
+    size_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) {
+        if (compare_entries(&src[j], &src[i], c) < 0) dst[k++] = src[j++];
+        else dst[k++] = src[i++];
+    }
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+// Устойчивая сортировка слиянием снизу вверх: куски по SORT_RUN вставками,
+// потом проходы слияния между a и tmp, каждый читает и пишет подряд.
+static void merge_sort(EntryInfo *a, EntryInfo *tmp, size_t n, const SortCtx *c) {
+    for (size_t lo = 0; lo < n; lo += SORT_RUN) {
+        size_t hi = lo + SORT_RUN < n ? lo + SORT_RUN : n;
+        for (size_t i = lo + 1; i < hi; ++i) {
+            EntryInfo e = a[i];
+            size_t j = i;
+            while (j > lo && compare_entries(&e, &a[j - 1], c) < 0) {
+                a[j] = a[j - 1];
+                --j;
+            }
+            a[j] = e;
+        }
+    }
+
+    EntryInfo *src = a, *dst = tmp;
+    for (size_t w = SORT_RUN; w < n; w *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * w) {
+            size_t mid = lo + w < n ? lo + w : n;
+            size_t hi = lo + 2 * w < n ? lo + 2 * w : n;
+            merge_runs(src, dst, lo, mid, hi, c);
+        }
+        EntryInfo *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != a) memcpy(a, src, n * sizeof(EntryInfo));
 }
 
-static void free_entry(EntryInfo *e) {
-    if (!e) return;
-    free(e->name);
-    free(e->fullPath);
+// Кусок параллельной сортировки: отсортировать [lo..hi) или слить
+// [lo..mid) с [mid..hi) из src в dst
+typedef struct SortTask {
+    EntryInfo *src;
+    EntryInfo *dst;
+    size_t lo, mid, hi;
+    const SortCtx *c;
+} SortTask;
+
+static void *sort_task(void *arg) {
+    SortTask *t = (SortTask *)arg;
+    if (t->mid == t->hi) merge_sort(t->src + t->lo, t->dst + t->lo, t->hi - t->lo, t->c);
+    else merge_runs(t->src, t->dst, t->lo, t->mid, t->hi, t->c);
+    return NULL;
+}
+
+// Задачи идут в потоках, последнюю выполняет вызывающий
+static void run_sort_tasks(SortTask *tasks, size_t n) {
+    pthread_t tids[64];
+    int started[64];
+    for (size_t t = 0; t + 1 < n; ++t) {
+        started[t] = pthread_create(&tids[t], NULL, sort_task, &tasks[t]) == 0;
+        if (!started[t]) sort_task(&tasks[t]);
+    }
+    sort_task(&tasks[n - 1]);
+    for (size_t t = 0; t + 1 < n; ++t) {
+        if (started[t]) pthread_join(tids[t], NULL);
+    }
+}
+
+// Сортирует l по opts. На больших каталогах куски сортируются в
+// opts->jobs потоках и сливаются попарно, тоже параллельно; порядок тот же,
+// что у одного потока. -1 без памяти.
+static int sort_listing(Listing *l, const Options *opts) {
+    if (opts->sortBy == SORT_NONE || l->len < 2) return 0;
+    if (listing_make_keys(l) != 0) return -1;
+
+    SortCtx c;
+    c.keys = listing_keys(l);
+    c.by = opts->sortBy;
+    c.reverse = opts->reverse;
+
+    size_t n = l->len;
+    EntryInfo *tmp = (EntryInfo *)malloc(n * sizeof(EntryInfo));
+    if (!tmp) return -1;
+
+    size_t parts = 1;
+    while (parts * 2 <= (size_t)opts->jobs && parts * 2 <= 64 && n / (parts * 2) >= PAR_SORT_MIN / 2) parts *= 2;
+    if (parts == 1 || n < PAR_SORT_MIN) {
+        merge_sort(l->entries, tmp, n, &c);
+        free(tmp);
+        return 0;
+    }
+
+    SortTask tasks[64];
+    for (size_t p = 0; p < parts; ++p) {
+        tasks[p].src = l->entries;
+        tasks[p].dst = tmp;
+        tasks[p].lo = n * p / parts;
+        tasks[p].mid = tasks[p].hi = n * (p + 1) / parts;
+        tasks[p].c = &c;
+    }
+    run_sort_tasks(tasks, parts);
+
+    EntryInfo *src = l->entries, *dst = tmp;
+    for (size_t w = 1; w < parts; w *= 2) {
+        size_t nt = 0;
+        for (size_t p = 0; p < parts; p += 2 * w) {
+            tasks[nt].src = src;
+            tasks[nt].dst = dst;
+            tasks[nt].lo = n * p / parts;
+            tasks[nt].mid = n * (p + w) / parts;
+            tasks[nt].hi = n * (p + 2 * w) / parts;
+            tasks[nt].c = &c;
+            nt++;
+        }
+        run_sort_tasks(tasks, nt);
+        EntryInfo *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != l->entries) memcpy(l->entries, src, n * sizeof(EntryInfo));
+    free(tmp);
+    return 0;
 }
 
 static void mode_to_string(mode_t mode, char out[11]) {
@@ -84,60 +415,449 @@ static void mode_to_string(mode_t mode, char out[11]) {
 #endif
 }
 
-static int is_executable(const struct stat *st) {
-    return (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+static int is_executable(mode_t mode) {
+    return (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+}
+
+// Весь вывод собирается здесь, без stdio и разбора форматов, и уходит
+// write'ом кусками по OUT_CHUNK. Буфер с fd < 0 только растёт: это
+// листинги -R, которые потом печатает main.
+typedef struct OutBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int fd;
+    int err;         // errno первой ошибки; дальше вывод отбрасывается
+    size_t records;  // --json: записей в буфере, для запятых
+} OutBuf;
+
+static OutBuf stdoutBuf = { NULL, 0, 0, STDOUT_FILENO, 0, 0 };
+static int stdoutTty;    // на терминал вывод уходит после каждого каталога
+
+static void out_flush(OutBuf *b) {
+    size_t done = 0;
+    while (b->fd >= 0 && done < b->len && !b->err) {
+        ssize_t n = write(b->fd, b->data + done, b->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            b->err = errno;
+            break;
+        }
+        done += (size_t)n;
+    }
+    b->len = 0;
+}
+
+// Место под n байт в конце буфера; NULL, если писать некуда
+static char *out_reserve(OutBuf *b, size_t n) {
+    if (b->cap - b->len >= n) return b->data + b->len;
+    if (b->fd >= 0 && b->len > 0) {
+        out_flush(b);
+        if (b->cap >= n) return b->data;
+    }
+    if (b->err) return NULL;
+    size_t newCap = b->cap ? b->cap : (b->fd >= 0 ? OUT_CHUNK : 4096);
+    while (newCap - b->len < n) newCap *= 2;
+    char *tmp = (char *)realloc(b->data, newCap);
+    if (!tmp) {
+        b->err = ENOMEM;
+        return NULL;
+    }
+    b->data = tmp;
+    b->cap = newCap;
+    return b->data + b->len;
+}
+
+static void out_bytes(OutBuf *b, const char *s, size_t n) {
+    char *p = n > 0 ? out_reserve(b, n) : NULL;
+    if (!p) return;
+    memcpy(p, s, n);
+    b->len += n;
+}
+
+static void out_str(OutBuf *b, const char *s) {
+    out_bytes(b, s, strlen(s));
 }
 
-static void print_name_with_color(const EntryInfo *e) {
-    const mode_t m = e->st.st_mode;
-    if (S_ISDIR(m)) {
-        printf(COLOR_BLUE "%s" COLOR_RESET, e->name);
+static void out_char(OutBuf *b, char c) {
+    char *p = out_reserve(b, 1);
+    if (!p) return;
+    *p = c;
+    b->len++;
+}
+
+// v по правому краю поля width (как "%*llu")
+static void out_uint(OutBuf *b, unsigned long long v, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    size_t total = (size_t)(width > n ? width : n);
+    char *p = out_reserve(b, total);
+    if (!p) return;
+    size_t pad = total - (size_t)n;
+    memset(p, ' ', pad);
+    for (int i = 0; i < n; ++i) p[pad + (size_t)i] = digits[n - 1 - i];
+    b->len += total;
+}
+
+static void out_int(OutBuf *b, long long v) {
+    if (v < 0) {
+        out_char(b, '-');
+        out_uint(b, 0ULL - (unsigned long long)v, 0);
+    } else {
+        out_uint(b, (unsigned long long)v, 0);
+    }
+}
+
+// s[0..n) по левому краю поля width (как "%-*s")
+static void out_str_pad(OutBuf *b, const char *s, int n, int width) {
+    size_t total = (size_t)(width > n ? width : n);
+    char *p = out_reserve(b, total);
+    if (!p) return;
+    memcpy(p, s, (size_t)n);
+    memset(p + n, ' ', total - (size_t)n);
+    b->len += total;
+}
+
+static void out_free(OutBuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+static void print_name_with_color(OutBuf *out, const char *name, mode_t m) {
+    if (!useColor) {
+        out_str(out, name);
+    } else if (S_ISDIR(m)) {
+        out_str(out, COLOR_BLUE);
+        out_str(out, name);
+        out_str(out, COLOR_RESET);
     } else if (S_ISLNK(m)) {
-        printf(COLOR_CYAN "%s" COLOR_RESET, e->name);
-    } else if (S_ISREG(m) && is_executable(&e->st)) {
-        printf(COLOR_GREEN "%s" COLOR_RESET, e->name);
+        out_str(out, COLOR_CYAN);
+        out_str(out, name);
+        out_str(out, COLOR_RESET);
+    } else if (S_ISREG(m) && is_executable(m)) {
+        out_str(out, COLOR_GREEN);
+        out_str(out, name);
+        out_str(out, COLOR_RESET);
     } else {
-        printf("%s", e->name);
+        out_str(out, name);
     }
 }
 
-static void print_long_entry(const EntryInfo *e, int w_links, int w_user, int w_group, int w_size) {
-    char modeStr[11];
-    mode_to_string(e->st.st_mode, modeStr);
+// Имя владельца или группы, один раз на id за процесс
+typedef struct IdName {
+    unsigned long id;
+    int len;
+    char *name;      // хранится сразу за структурой
+} IdName;
+
+typedef struct IdCache {
+    IdName **slots;  // открытая адресация, cap - степень двойки; записи не двигаются
+    size_t cap;
+    size_t count;
+} IdCache;
+
+static IdCache userCache, groupCache;
+static pthread_mutex_t idCacheMu = PTHREAD_MUTEX_INITIALIZER;   // -R листает из нескольких потоков
+static int numericIds;   // -n: имена не ищем
+
+static size_t id_hash(unsigned long id, size_t cap) {
+    return (size_t)(((unsigned long long)id * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
 
-    struct passwd *pw = getpwuid(e->st.st_uid);
-    struct group *gr = getgrgid(e->st.st_gid);
-    const char *user = pw ? pw->pw_name : "?";
-    const char *group = gr ? gr->gr_name : "?";
+static int id_cache_grow(IdCache *c) {
+    size_t newCap = c->cap ? c->cap * 2 : 64;
+    IdName **slots = (IdName **)calloc(newCap, sizeof(IdName *));
+    if (!slots) return -1;
+    for (size_t i = 0; i < c->cap; ++i) {
+        if (!c->slots[i]) continue;
+        size_t j = id_hash(c->slots[i]->id, newCap);
+        while (slots[j]) j = (j + 1) & (newCap - 1);
+        slots[j] = c->slots[i];
+    }
+    free(c->slots);
+    c->slots = slots;
+    c->cap = newCap;
+    return 0;
+}
+
+static IdName *id_cache_find(const IdCache *c, unsigned long id) {
+    if (!c->cap) return NULL;
+    size_t i = id_hash(id, c->cap);
+    while (c->slots[i]) {
+        if (c->slots[i]->id == id) return c->slots[i];
+        i = (i + 1) & (c->cap - 1);
+    }
+    return NULL;
+}
+
+// getpwuid/getgrgid на NSS/LDAP может ходить по сети, поэтому результат
+// запоминается и для compute_widths, и для печати. Неизвестный id и -n
+// печатаются числом, как в ls.
+static const IdName *lookup_id(IdCache *c, unsigned long id, int isGroup) {
+    static const IdName unknown = { 0, 1, "?" };
+    pthread_mutex_lock(&idCacheMu);
+    IdName *found = id_cache_find(c, id);
+    if (found || ((c->count + 1) * 2 > c->cap && id_cache_grow(c) != 0)) {
+        pthread_mutex_unlock(&idCacheMu);
+        return found ? found : &unknown;
+    }
+
+    const char *name = NULL;
+    if (!numericIds) {
+        if (isGroup) {
+            struct group *gr = getgrgid((gid_t)id);
+            if (gr) name = gr->gr_name;
+        } else {
+            struct passwd *pw = getpwuid((uid_t)id);
+            if (pw) name = pw->pw_name;
+        }
+    }
+    char num[24];
+    if (!name) {
+        snprintf(num, sizeof(num), "%lu", id);
+        name = num;
+    }
+    size_t len = strlen(name);
+    found = (IdName *)malloc(sizeof(IdName) + len + 1);
+    if (found) {
+        found->id = id;
+        found->len = (int)len;
+        found->name = (char *)(found + 1);
+        memcpy(found->name, name, len + 1);
 
-    char timeBuf[64];
-    struct tm *lt = localtime(&e->st.st_mtime);
+        size_t i = id_hash(id, c->cap);
+        while (c->slots[i]) i = (i + 1) & (c->cap - 1);
+        c->slots[i] = found;
+        c->count++;
+    }
+    pthread_mutex_unlock(&idCacheMu);
+    return found ? found : &unknown;
+}
+
+static const IdName *user_of(uid_t uid) {
+    return lookup_id(&userCache, (unsigned long)uid, 0);
+}
+
+static const IdName *group_of(gid_t gid) {
+    return lookup_id(&groupCache, (unsigned long)gid, 1);
+}
+
+static void free_id_cache(IdCache *c) {
+    for (size_t i = 0; i < c->cap; ++i) free(c->slots[i]);
+    free(c->slots);
+    memset(c, 0, sizeof(*c));
+}
+
+// Дата для -l. localtime и strftime зовутся раз на минуту: слот хранит
+// строку и интервал [from, to), на котором она верна. У каждого потока
+// свой кэш.
+typedef struct DateSlot {
+    time_t from;
+    time_t to;
+    char text[16];
+    int len;
+} DateSlot;
+
+static _Thread_local DateSlot dateCache[DATE_CACHE_SLOTS];
+
+static const DateSlot *format_date(time_t t) {
+    time_t minute = t / 60 - (t % 60 < 0);
+    DateSlot *slot = &dateCache[(size_t)minute % DATE_CACHE_SLOTS];
+    if (t >= slot->from && t < slot->to && slot->len > 0) return slot;
+
+    struct tm tmBuf;
+    struct tm *lt = localtime_r(&t, &tmBuf);
     if (lt) {
-        strftime(timeBuf, sizeof(timeBuf), "%b %e %H:%M", lt);
-    } else {
-        strncpy(timeBuf, "??? ?? ??:??", sizeof(timeBuf));
-        timeBuf[sizeof(timeBuf)-1] = '\0';
+        slot->len = (int)strftime(slot->text, sizeof(slot->text), "%b %e %H:%M", lt);
+        slot->from = t - lt->tm_sec;
+        slot->to = slot->from + 60;
+    }
+    if (!lt || slot->len == 0) {
+        memcpy(slot->text, "??? ?? ??:??", 13);
+        slot->len = 12;
+        slot->from = slot->to = t;    // не кэшируется
     }
+    return slot;
+}
+
+static void print_long_entry(OutBuf *out, const Listing *l, const EntryInfo *e, int w_links, int w_user,
+                             int w_group, int w_size) {
+    char modeStr[11];
+    mode_to_string(e->mode, modeStr);
+
+    const IdName *user = user_of(e->uid);
+    const IdName *group = group_of(e->gid);
+    const DateSlot *date = format_date(e->mtime);
+
+    out_bytes(out, modeStr, 10);
+    out_char(out, ' ');
+    out_uint(out, (unsigned long long)e->nlink, w_links);
+    out_char(out, ' ');
+    out_str_pad(out, user->name, user->len, w_user);
+    out_char(out, ' ');
+    out_str_pad(out, group->name, group->len, w_group);
+    out_char(out, ' ');
+    out_uint(out, (unsigned long long)e->size, w_size);
+    out_char(out, ' ');
+    out_bytes(out, date->text, (size_t)date->len);
+    out_char(out, ' ');
+
+    print_name_with_color(out, entry_name(l, e), e->mode);
+
+    if (e->linkOff) {
+        out_bytes(out, " -> ", 4);
+        out_str(out, l->names.data + e->linkOff);
+    }
+    out_char(out, eol);
+}
 
-    printf("%s %*lu %-*s %-*s %*lld %s ",
-           modeStr,
-           w_links, (unsigned long)e->st.st_nlink,
-           w_user, user,
-           w_group, group,
-           w_size, (long long)e->st.st_size,
-           timeBuf);
+// Длина корректной UTF-8 последовательности в начале p[0..n), 0 если её нет
+static size_t utf8_seq(const unsigned char *p, size_t n) {
+    size_t len;
+    unsigned long cp, min;
+    if (p[0] < 0xc2) return 0;
+    if (p[0] < 0xe0) { len = 2; cp = p[0] & 0x1f; min = 0x80; }
+    else if (p[0] < 0xf0) { len = 3; cp = p[0] & 0x0f; min = 0x800; }
+    else if (p[0] < 0xf5) { len = 4; cp = p[0] & 0x07; min = 0x10000; }
+    else return 0;
+    if (n < len) return 0;
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80) return 0;
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return 0;
+    return len;
+}
 
-    print_name_with_color(e);
+// s[0..n) внутри JSON-строки. Кавычка, '\\' и управляющие символы
+// экранируются. Имена в Linux - произвольные байты: байт, который не
+// складывается в UTF-8, выводится как \u00XX.
+static void out_json_chars(OutBuf *b, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)s;
+    size_t i = 0;
+    while (i < n) {
+        size_t start = i;
+        while (i < n && p[i] >= 0x20 && p[i] < 0x80 && p[i] != '"' && p[i] != '\\') i++;
+        out_bytes(b, s + start, i - start);
+        if (i == n) break;
 
-    if (S_ISLNK(e->st.st_mode)) {
-        char target[PATH_MAX];
-        ssize_t n = readlink(e->fullPath, target, sizeof(target) - 1);
-        if (n >= 0) {
-            target[n] = '\0';
-            printf(" -> %s", target);
+        size_t k = p[i] >= 0x80 ? utf8_seq(p + i, n - i) : 0;
+        if (k > 0) {
+            out_bytes(b, s + i, k);
+            i += k;
+            continue;
+        }
+        char esc[6] = { '\\', 'u', '0', '0', hex[p[i] >> 4], hex[p[i] & 0xf] };
+        if (p[i] == '"' || p[i] == '\\') {
+            out_char(b, '\\');
+            out_char(b, (char)p[i]);
+        } else if (p[i] == '\n') {
+            out_bytes(b, "\\n", 2);
+        } else if (p[i] == '\t') {
+            out_bytes(b, "\\t", 2);
+        } else {
+            out_bytes(b, esc, 6);
         }
+        i++;
+    }
+}
+
+static const char *type_name(mode_t m) {
+    if (S_ISREG(m)) return "file";
+    if (S_ISDIR(m)) return "dir";
+    if (S_ISLNK(m)) return "symlink";
+    if (S_ISCHR(m)) return "char";
+    if (S_ISBLK(m)) return "block";
+    if (S_ISFIFO(m)) return "fifo";
+#ifdef S_ISSOCK
+    if (S_ISSOCK(m)) return "socket";
+#endif
+    return "unknown";
+}
+
+// Запись --json/--ndjson. path - это dir[0..dirLen) и имя записи. В
+// --json перед записью идёт ",\n", кроме первой на stdout; в буферах -R
+// запятая есть всегда, и лишнюю срезает walk_emit.
+static void print_json_entry(OutBuf *out, const Options *opts, const Listing *l, const EntryInfo *e,
+                             const char *dir, size_t dirLen) {
+    if (opts->format == FORMAT_JSON) {
+        if (out->fd >= 0 && out->records == 0) out_char(out, '\n');
+        else out_bytes(out, ",\n", 2);
+        out->records++;
+    }
+
+    const char *name = entry_name(l, e);
+    size_t nameLen = strlen(name);
+    char modeStr[11];
+    mode_to_string(e->mode, modeStr);
+
+    out_str(out, "{\"path\":\"");
+    out_json_chars(out, dir, dirLen);
+    if (dirLen > 0 && dir[dirLen - 1] != '/') out_char(out, '/');
+    out_json_chars(out, name, nameLen);
+    out_str(out, "\",\"name\":\"");
+    out_json_chars(out, name, nameLen);
+    out_str(out, "\",\"type\":\"");
+    out_str(out, type_name(e->mode));
+    out_str(out, "\",\"mode\":\"");
+    out_str(out, modeStr);
+    out_str(out, "\",\"nlink\":");
+    out_uint(out, (unsigned long long)e->nlink, 0);
+    out_str(out, ",\"uid\":");
+    out_uint(out, (unsigned long long)e->uid, 0);
+    out_str(out, ",\"gid\":");
+    out_uint(out, (unsigned long long)e->gid, 0);
+    const IdName *user = user_of(e->uid);
+    const IdName *group = group_of(e->gid);
+    out_str(out, ",\"user\":\"");
+    out_json_chars(out, user->name, (size_t)user->len);
+    out_str(out, "\",\"group\":\"");
+    out_json_chars(out, group->name, (size_t)group->len);
+    out_str(out, "\",\"size\":");
+    out_int(out, (long long)e->size);
+    out_str(out, ",\"blocks\":");
+    out_int(out, (long long)e->blocks);
+    out_str(out, ",\"mtime\":");
+    out_int(out, (long long)e->mtime);
+    out_str(out, ",\"mtime_nsec\":");
+    out_int(out, e->mtimeNsec);
+    if (e->linkOff) {
+        const char *target = l->names.data + e->linkOff;
+        out_str(out, ",\"target\":\"");
+        out_json_chars(out, target, strlen(target));
+        out_char(out, '"');
+    }
+    out_char(out, '}');
+    if (opts->format == FORMAT_NDJSON) out_char(out, '\n');
+}
+
+// Цель симлинка name относительно каталога dfd — в арену, в e->linkOff
+static void read_link_target(Listing *l, EntryInfo *e, int dfd, const char *name) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(dfd, name, target, sizeof(target) - 1);
+    if (n >= 0) e->linkOff = arena_add(&l->names, target, (size_t)n);
+}
+
+// Тип файла из d_type, 0 если файловая система его не сообщает
+static mode_t mode_from_dtype(unsigned char type) {
+    switch (type) {
+    case DT_DIR: return S_IFDIR;
+    case DT_REG: return S_IFREG;
+    case DT_LNK: return S_IFLNK;
+    case DT_CHR: return S_IFCHR;
+    case DT_BLK: return S_IFBLK;
+    case DT_FIFO: return S_IFIFO;
+#ifdef S_IFSOCK
+    case DT_SOCK: return S_IFSOCK;
+#endif
+    default: return 0;
     }
-    putchar('\n');
 }
 
 typedef struct Widths {
@@ -157,147 +877,1098 @@ static void compute_widths(const EntryInfo *arr, size_t n, Widths *w) {
     memset(w, 0, sizeof(*w));
     for (size_t i = 0; i < n; ++i) {
         const EntryInfo *e = &arr[i];
-        if (num_digits_unsigned((unsigned long long)e->st.st_nlink) > w->w_links)
-            w->w_links = num_digits_unsigned((unsigned long long)e->st.st_nlink);
+        if (num_digits_unsigned((unsigned long long)e->nlink) > w->w_links)
+            w->w_links = num_digits_unsigned((unsigned long long)e->nlink);
 
-        struct passwd *pw = getpwuid(e->st.st_uid);
-        struct group *gr = getgrgid(e->st.st_gid);
-        int ulen = (int)strlen(pw ? pw->pw_name : "?");
-        int glen = (int)strlen(gr ? gr->gr_name : "?");
+        int ulen = user_of(e->uid)->len;
+        int glen = group_of(e->gid)->len;
         if (ulen > w->w_user) w->w_user = ulen;
         if (glen > w->w_group) w->w_group = glen;
 
-        int sz = num_digits_unsigned((unsigned long long)e->st.st_size);
+        int sz = num_digits_unsigned((unsigned long long)e->size);
         if (sz > w->w_size) w->w_size = sz;
     }
 }
 
-static int list_directory(const char *path, const Options *opts, int print_header) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        fprintf(stderr, "myls: cannot access '%s': %s\n", path, strerror(errno));
-        return 1;
-    }
+// Запись, которую возвращает getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    if (print_header) {
-        printf("%s:\n", path);
+// Один вызов getdents64 в buf (DENTS_BUF_SIZE байт): записи каталога dfd
+// добавляются в l, имена в арену, тип из d_type. stat делает
+// stat_entries. 1 - блок прочитан, 0 - каталог кончился, -1 - ошибка
+// (уже сообщена).
+static int read_dents(int dfd, const char *path, char *buf, const Options *opts, Listing *l, FILE *err) {
+    long n;
+    do {
+        n = syscall(SYS_getdents64, dfd, buf, DENTS_BUF_SIZE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        fprintf(err, "myls: reading directory '%s': %s\n", path, strerror(errno));
+        return -1;
     }
+    if (n == 0) return 0;
 
-    EntryInfo *entries = NULL;
-    size_t cap = 0, len = 0;
-
-    struct dirent *de;
-    while ((de = readdir(dir)) != NULL) {
+    for (long pos = 0; pos < n;) {
+        const struct linux_dirent64 *de = (const struct linux_dirent64 *)(buf + pos);
+        pos += de->d_reclen;
         const char *name = de->d_name;
         if (!opts->showAll && name[0] == '.') continue;
 
-        if (len == cap) {
-            size_t newCap = cap ? cap * 2 : 64;
-            EntryInfo *tmp = (EntryInfo *)realloc(entries, newCap * sizeof(EntryInfo));
-            if (!tmp) {
-                perror("realloc");
-                closedir(dir);
-                for (size_t i = 0; i < len; ++i) free_entry(&entries[i]);
-                free(entries);
-                return 1;
-            }
-            entries = tmp;
-            cap = newCap;
+        EntryInfo *e = listing_add(l, name, strlen(name));
+        if (!e) {
+            fprintf(err, "malloc: %s\n", strerror(errno));
+            return -1;
+        }
+
+        e->mode = mode_from_dtype(de->d_type);
+    }
+    return 1;
+}
+
+// Короткому списку хватает типа из d_type; stat нужен для -l, JSON, -t, -S,
+// --du (кроме каталогов: их считает свой узел), для цвета исполняемых
+// файлов и там, где d_type неизвестен.
+static int needs_stat(const Options *opts, mode_t type) {
+    return opts->longList || opts->format != FORMAT_TEXT || opts->sortBy == SORT_TIME || opts->sortBy == SORT_SIZE ||
+           type == 0 || (opts->du && !S_ISDIR(type)) || (useColor && S_ISREG(type));
+}
+
+// statx просит только поля, которые печатает myls; это дешевле на NFS/FUSE.
+// Возвращает 0 или errno.
+static int stat_entry(int dfd, const char *name, EntryInfo *e) {
+    struct statx stx;
+    unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                    STATX_SIZE | STATX_BLOCKS | STATX_MTIME | STATX_INO;
+    if (statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &stx) == 0) {
+        e->size = (off_t)stx.stx_size;
+        e->blocks = (blkcnt_t)stx.stx_blocks;
+        e->mtime = (time_t)stx.stx_mtime.tv_sec;
+        e->mtimeNsec = (long)stx.stx_mtime.tv_nsec;
+        e->nlink = (nlink_t)stx.stx_nlink;
+        e->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        e->ino = (ino_t)stx.stx_ino;
+        e->uid = (uid_t)stx.stx_uid;
+        e->gid = (gid_t)stx.stx_gid;
+        e->mode = (mode_t)stx.stx_mode;
+        return 0;
+    }
+    if (errno != ENOSYS) return errno;
+
+    struct stat st;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return errno;
+    entry_set_stat(e, &st);
+    return 0;
+}
+
+// Общая очередь stat'ов одного каталога: потоки забирают по STAT_BATCH записей
+typedef struct StatPool {
+    int dfd;
+    const Options *opts;
+    Listing *l;
+    atomic_size_t next;
+} StatPool;
+
+static void stat_range(StatPool *pool, size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i) {
+        EntryInfo *e = &pool->l->entries[i];
+        if (needs_stat(pool->opts, e->mode)) {
+            e->statErr = stat_entry(pool->dfd, entry_name(pool->l, e), e);
         }
+    }
+}
 
-        EntryInfo *e = &entries[len];
-        memset(e, 0, sizeof(*e));
-        e->name = strdup(name);
+static void *stat_worker(void *arg) {
+    StatPool *pool = (StatPool *)arg;
+    for (;;) {
+        size_t from = atomic_fetch_add(&pool->next, STAT_BATCH);
+        if (from >= pool->l->len) break;
+        size_t to = from + STAT_BATCH < pool->l->len ? from + STAT_BATCH : pool->l->len;
+        stat_range(pool, from, to);
+    }
+    return NULL;
+}
 
-        size_t pathLen = strlen(path);
-        size_t nameLen = strlen(name);
-        int needSlash = (pathLen > 0 && path[pathLen - 1] != '/');
-        e->fullPath = (char *)malloc(pathLen + needSlash + nameLen + 1);
-        if (!e->fullPath || !e->name) {
-            perror("malloc");
-            closedir(dir);
-            for (size_t i = 0; i < len; ++i) free_entry(&entries[i]);
-            free(entries);
-            return 1;
+// stat для записей, которым он нужен. На больших каталогах запросы идут из
+// opts->jobs потоков одновременно: на NFS и FUSE каждый stat - это поход
+// по сети. Потом, в порядке каталога, выбрасываются записи с ошибкой и
+// читаются цели симлинков, так что результат не зависит от числа потоков.
+static void stat_entries(int dfd, const char *path, const Options *opts, Listing *l, FILE *err) {
+    StatPool pool;
+    pool.dfd = dfd;
+    pool.opts = opts;
+    pool.l = l;
+    atomic_init(&pool.next, 0);
+
+    int nthreads = 0;
+    pthread_t tids[64];
+    if (opts->jobs > 1 && l->len >= PAR_STAT_MIN) {
+        int want = opts->jobs < 64 ? opts->jobs : 64;
+        for (int t = 0; t < want; ++t) {
+            if (pthread_create(&tids[nthreads], NULL, stat_worker, &pool) == 0) nthreads++;
         }
-        strcpy(e->fullPath, path);
-        if (needSlash) strcat(e->fullPath, "/");
-        strcat(e->fullPath, name);
+    }
+    stat_worker(&pool);
+    for (int t = 0; t < nthreads; ++t) pthread_join(tids[t], NULL);
 
-        if (lstat(e->fullPath, &e->st) != 0) {
-            fprintf(stderr, "myls: cannot stat '%s': %s\n", e->fullPath, strerror(errno));
-            free_entry(e);
+    size_t kept = 0;
+    for (size_t i = 0; i < l->len; ++i) {
+        EntryInfo *e = &l->entries[i];
+        const char *name = entry_name(l, e);
+        if (e->statErr != 0) {
+            int pathLen = (int)strlen(path);
+            fprintf(err, "myls: cannot stat '%s%s%s': %s\n", path,
+                    (pathLen > 0 && path[pathLen - 1] != '/') ? "/" : "", name, strerror(e->statErr));
             continue;
         }
-        e->isSymlink = S_ISLNK(e->st.st_mode);
-        len++;
+        if ((opts->longList || opts->format != FORMAT_TEXT) && S_ISLNK(e->mode)) {
+            read_link_target(l, e, dfd, name);
+        }
+        l->entries[kept++] = *e;
     }
-    closedir(dir);
+    l->len = kept;
+}
+
+// "dir/name"; слэш не удваивается
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = (dlen > 0 && dir[dlen - 1] != '/');
+    char *p = (char *)malloc(dlen + (size_t)slash + nlen + 1);
+    if (!p) return NULL;
+    memcpy(p, dir, dlen);
+    if (slash) p[dlen] = '/';
+    memcpy(p + dlen + slash, name, nlen + 1);
+    return p;
+}
 
-    qsort(entries, len, sizeof(EntryInfo), compare_entries_alpha);
+// Подкаталоги для -R: полные пути в порядке вывода
+typedef struct SubdirList {
+    char **paths;
+    size_t len;
+    size_t cap;
+} SubdirList;
 
-    if (opts->longList) {
+static int subdirs_add(SubdirList *sd, char *path) {
+    if (!path) return -1;
+    if (sd->len == sd->cap) {
+        size_t newCap = sd->cap ? sd->cap * 2 : 16;
+        char **tmp = (char **)realloc(sd->paths, newCap * sizeof(char *));
+        if (!tmp) {
+            free(path);
+            return -1;
+        }
+        sd->paths = tmp;
+        sd->cap = newCap;
+    }
+    sd->paths[sd->len++] = path;
+    return 0;
+}
+
+static void listing_reset(Listing *l) {
+    l->len = 0;
+    l->names.len = 0;
+    l->keys.len = 0;
+}
+
+// Сортирует и печатает записи l каталога path, подкаталоги - в subdirs
+static int print_listing(const char *path, const Options *opts, Listing *l, int withTotal, OutBuf *out,
+                         FILE *err, SubdirList *subdirs) {
+    int rc = 0;
+    if (sort_listing(l, opts) != 0) {
+        fprintf(err, "malloc: %s\n", strerror(errno));
+        rc = 1;
+    }
+    EntryInfo *entries = l->entries;
+    size_t len = l->len;
+    int text = opts->format == FORMAT_TEXT;
+
+    if (text && opts->longList && withTotal) {
         long long totalBlocks = 0;
-        for (size_t i = 0; i < len; ++i) totalBlocks += entries[i].st.st_blocks;
-       
-        printf("total %lld\n", totalBlocks / 2);
+        for (size_t i = 0; i < len; ++i) totalBlocks += entries[i].blocks;
+
+        out_bytes(out, "total ", 6);
+        out_uint(out, (unsigned long long)(totalBlocks / 2), 0);
+        out_char(out, eol);
     }
 
     Widths w;
-    if (opts->longList) compute_widths(entries, len, &w);
+    if (text && opts->longList) compute_widths(entries, len, &w);
 
     for (size_t i = 0; i < len; ++i) {
-        if (opts->longList) {
-            print_long_entry(&entries[i], w.w_links, w.w_user, w.w_group, w.w_size);
+        if (!text) {
+            print_json_entry(out, opts, l, &entries[i], path, strlen(path));
+        } else if (opts->longList) {
+            print_long_entry(out, l, &entries[i], w.w_links, w.w_user, w.w_group, w.w_size);
+        } else {
+            print_name_with_color(out, entry_name(l, &entries[i]), entries[i].mode);
+            out_char(out, eol);
+        }
+    }
+
+    for (size_t i = 0; subdirs && i < len; ++i) {
+        const char *name = entry_name(l, &entries[i]);
+        if (!S_ISDIR(entries[i].mode) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (subdirs_add(subdirs, join_path(path, name)) != 0) {
+            fprintf(err, "malloc: %s\n", strerror(errno));
+            rc = 1;
+            break;
+        }
+    }
+    return rc;
+}
+
+// Печатает каталог в out, ошибки - в err. Если subdirs не NULL, туда
+// попадают его подкаталоги (без "." и "..") в том же порядке.
+//
+// Когда порядок не нужен (-U) и не нужны ширины колонок (-l в тексте),
+// каждый блок getdents64 печатается сразу и выбрасывается: вывод идёт с
+// первого блока, а память не зависит от размера каталога.
+static int list_directory(const char *path, const Options *opts, int print_header, OutBuf *out, FILE *err,
+                          SubdirList *subdirs) {
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        fprintf(err, "myls: cannot access '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    char *buf = (char *)malloc(DENTS_BUF_SIZE);
+    if (!buf) {
+        fprintf(err, "malloc: %s\n", strerror(errno));
+        close(dfd);
+        return 1;
+    }
+
+    if (print_header && opts->format == FORMAT_TEXT) {
+        out_str(out, path);
+        out_bytes(out, ":\n", 2);
+    }
+
+    int stream = opts->sortBy == SORT_NONE && (opts->format != FORMAT_TEXT || !opts->longList);
+    Listing l;
+    memset(&l, 0, sizeof(l));
+    int rc = 0;
+    for (;;) {
+        int more = read_dents(dfd, path, buf, opts, &l, err);
+        if (more < 0) rc = 1;
+        if (more > 0 && !stream) continue;
+
+        stat_entries(dfd, path, opts, &l, err);
+        // Без единой записи после ошибки чтения "total" не печатается
+        if (!(more < 0 && l.len == 0 && !stream)) {
+            rc |= print_listing(path, opts, &l, !stream, out, err, subdirs);
+        }
+        listing_reset(&l);
+        if (more <= 0) break;
+    }
+
+    free(buf);
+    close(dfd);
+    listing_free(&l);
+    return rc;
+}
+
+// -R: каталоги дерева листаются параллельно, а печатаются в порядке ls -R
+// (обход в глубину, подкаталоги в порядке вывода). Готовые, но ещё не
+// напечатанные листинги копятся в памяти; когда их больше WALK_BUDGET байт,
+// рабочие потоки ждут, а нужный следующим каталог main листает сам.
+typedef struct DirNode {
+    char *path;
+    struct DirNode **children;   // подкаталоги, когда state == NODE_DONE
+    size_t nchildren;
+    OutBuf out;                  // листинг
+    char *err;                   // сообщения об ошибках
+    size_t errLen;
+    int rc;
+    int state;
+    atomic_int refs;             // очередь и родитель
+} DirNode;
+
+enum { NODE_QUEUED, NODE_RUNNING, NODE_DONE };
+
+// Очередь каталогов одного потока (DirNode для -R, DuNode для --du).
+// Владелец кладёт и берёт с конца, простаивающие потоки крадут с начала.
+typedef struct WalkDeque {
+    void **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    pthread_mutex_t mu;
+} WalkDeque;
+
+typedef struct Walker {
+    const Options *opts;
+    WalkDeque *deques;
+    size_t nworkers;
+    pthread_mutex_t mu;          // state, children и buffered всех узлов
+    pthread_cond_t nodeDone;
+    pthread_cond_t wake;         // появилась работа, освободился бюджет или stop
+    size_t buffered;             // байт в готовых, ещё не напечатанных листингах
+    unsigned long wakeups;
+    int stop;
+} Walker;
+
+typedef struct WalkWorker {
+    Walker *walker;
+    size_t id;
+} WalkWorker;
+
+static DirNode *node_new(char *path) {
+    DirNode *n = (DirNode *)calloc(1, sizeof(DirNode));
+    if (!n) return NULL;
+    n->path = path;
+    n->state = NODE_QUEUED;
+    atomic_init(&n->refs, 1);
+    return n;
+}
+
+static void node_release(DirNode *n) {
+    if (n && atomic_fetch_sub(&n->refs, 1) == 1) {
+        free(n->path);
+        free(n->children);
+        out_free(&n->out);
+        free(n->err);
+        free(n);
+    }
+}
+
+static int deque_push(WalkDeque *dq, void *n) {
+    int rc = 0;
+    pthread_mutex_lock(&dq->mu);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(void *));
+            dq->tail -= dq->head;
+            dq->head = 0;
         } else {
-            print_name_with_color(&entries[i]);
-            putchar('\n');
+            size_t newCap = dq->cap ? dq->cap * 2 : 64;
+            void **tmp = (void **)realloc(dq->items, newCap * sizeof(void *));
+            if (tmp) {
+                dq->items = tmp;
+                dq->cap = newCap;
+            } else {
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0) dq->items[dq->tail++] = n;
+    pthread_mutex_unlock(&dq->mu);
+    return rc;
+}
+
+static void *deque_take(WalkDeque *dq, int steal) {
+    void *n = NULL;
+    pthread_mutex_lock(&dq->mu);
+    if (dq->head < dq->tail) {
+        n = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+        if (dq->head == dq->tail) dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->mu);
+    return n;
+}
+
+// Листает каталог узла в память и ставит его подкаталоги в очередь deque
+// (без потоков - никуда: их возьмёт main, когда дойдёт).
+static void walk_node(Walker *wk, DirNode *n, WalkDeque *dq) {
+    FILE *err = open_memstream(&n->err, &n->errLen);
+    SubdirList sd;
+    memset(&sd, 0, sizeof(sd));
+    n->out.fd = -1;
+    if (err) {
+        n->rc = list_directory(n->path, wk->opts, 1, &n->out, err, &sd);
+        if (n->out.err) {
+            fprintf(err, "myls: %s: %s\n", n->path, strerror(n->out.err));
+            n->rc = 1;
+        }
+        fclose(err);
+    } else {
+        fprintf(stderr, "myls: %s\n", strerror(errno));
+        n->rc = 1;
+    }
+
+    DirNode **children = sd.len ? (DirNode **)calloc(sd.len, sizeof(DirNode *)) : NULL;
+    size_t nchildren = 0;
+    for (size_t i = 0; i < sd.len; ++i) {
+        DirNode *c = children ? node_new(sd.paths[i]) : NULL;
+        if (!c) {
+            free(sd.paths[i]);
+            n->rc = 1;
+            continue;
+        }
+        children[nchildren++] = c;
+    }
+    free(sd.paths);
+
+    // В обратном порядке: владелец снимает с конца и идёт по порядку вывода
+    int pushed = 0;
+    for (size_t i = nchildren; dq && i-- > 0;) {
+        atomic_fetch_add(&children[i]->refs, 1);
+        if (deque_push(dq, children[i]) != 0) {
+            atomic_fetch_sub(&children[i]->refs, 1);
+            continue;
+        }
+        pushed = 1;
+    }
+
+    pthread_mutex_lock(&wk->mu);
+    n->children = children;
+    n->nchildren = nchildren;
+    n->state = NODE_DONE;
+    wk->buffered += n->out.len + n->errLen;
+    if (pushed) wk->wakeups++;
+    pthread_cond_broadcast(&wk->nodeDone);
+    if (pushed) pthread_cond_broadcast(&wk->wake);
+    pthread_mutex_unlock(&wk->mu);
+}
+
+static DirNode *walker_next(WalkWorker *w) {
+    Walker *wk = w->walker;
+    DirNode *n = deque_take(&wk->deques[w->id], 0);
+    for (size_t k = 1; !n && k < wk->nworkers; ++k) {
+        n = deque_take(&wk->deques[(w->id + k) % wk->nworkers], 1);
+    }
+    return n;
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *w = (WalkWorker *)arg;
+    Walker *wk = w->walker;
+
+    for (;;) {
+        pthread_mutex_lock(&wk->mu);
+        while (!wk->stop && wk->buffered > WALK_BUDGET) pthread_cond_wait(&wk->wake, &wk->mu);
+        unsigned long seen = wk->wakeups;
+        int stop = wk->stop;
+        pthread_mutex_unlock(&wk->mu);
+        if (stop) break;
+
+        DirNode *n = walker_next(w);
+        if (!n) {
+            pthread_mutex_lock(&wk->mu);
+            while (!wk->stop && wk->wakeups == seen) pthread_cond_wait(&wk->wake, &wk->mu);
+            pthread_mutex_unlock(&wk->mu);
+            continue;
         }
+
+        // main мог уже взять этот каталог сам
+        pthread_mutex_lock(&wk->mu);
+        int mine = (n->state == NODE_QUEUED);
+        if (mine) n->state = NODE_RUNNING;
+        pthread_mutex_unlock(&wk->mu);
+        if (mine) walk_node(wk, n, &wk->deques[w->id]);
+        node_release(n);
+    }
+    return NULL;
+}
+
+// Печатает дерево root в порядке ls -R. Каталог, до которого дошла
+// печать, но который ещё никто не взял, main листает сам, так что печать
+// продвигается и когда рабочие потоки стоят из-за бюджета.
+static int walk_emit(Walker *wk, DirNode *root) {
+    int rc = 0;
+    size_t cap = 64, top = 0;
+    DirNode **stack = (DirNode **)malloc(cap * sizeof(DirNode *));
+    if (!stack) {
+        perror("malloc");
+        node_release(root);
+        return 1;
     }
+    stack[top++] = root;
+    int first = 1;
+
+    while (top > 0) {
+        DirNode *n = stack[--top];
+
+        pthread_mutex_lock(&wk->mu);
+        while (n->state != NODE_DONE) {
+            if (n->state == NODE_QUEUED) {
+                n->state = NODE_RUNNING;
+                pthread_mutex_unlock(&wk->mu);
+                walk_node(wk, n, wk->nworkers ? &wk->deques[0] : NULL);
+                pthread_mutex_lock(&wk->mu);
+            } else {
+                pthread_cond_wait(&wk->nodeDone, &wk->mu);
+            }
+        }
+        pthread_mutex_unlock(&wk->mu);
 
-    for (size_t i = 0; i < len; ++i) free_entry(&entries[i]);
-    free(entries);
+        if (!first && wk->opts->format == FORMAT_TEXT) out_char(&stdoutBuf, '\n');
+        first = 0;
+        const char *data = n->out.data;
+        size_t len = n->out.len;
+        if (n->out.records > 0 && stdoutBuf.records == 0) {
+            data++;    // первая запись на stdout - без запятой
+            len--;
+        }
+        out_bytes(&stdoutBuf, data, len);
+        stdoutBuf.records += n->out.records;
+        if (n->errLen > 0 || stdoutTty) out_flush(&stdoutBuf);
+        if (n->errLen > 0) fwrite(n->err, 1, n->errLen, stderr);
+        rc |= n->rc;
+
+        pthread_mutex_lock(&wk->mu);
+        wk->buffered -= n->out.len + n->errLen;
+        wk->wakeups++;
+        pthread_cond_broadcast(&wk->wake);
+        pthread_mutex_unlock(&wk->mu);
+        out_free(&n->out);
+        free(n->err);
+        n->err = NULL;
+        n->errLen = 0;
+
+        if (top + n->nchildren > cap) {
+            size_t newCap = cap;
+            while (newCap < top + n->nchildren) newCap *= 2;
+            DirNode **tmp = (DirNode **)realloc(stack, newCap * sizeof(DirNode *));
+            if (!tmp) {
+                perror("realloc");
+                rc = 1;
+                node_release(n);
+                break;
+            }
+            stack = tmp;
+            cap = newCap;
+        }
+        for (size_t i = n->nchildren; i-- > 0;) stack[top++] = n->children[i];
+        n->nchildren = 0;
+        node_release(n);
+    }
+
+    while (top > 0) node_release(stack[--top]);
+    free(stack);
+    return rc;
+}
+
+// -R для одного каталога-аргумента
+static int list_tree(const char *path, const Options *opts) {
+    char *rootPath = strdup(path);
+    DirNode *root = rootPath ? node_new(rootPath) : NULL;
+    if (!root) {
+        free(rootPath);
+        perror("malloc");
+        return 1;
+    }
+
+    Walker wk;
+    memset(&wk, 0, sizeof(wk));
+    wk.opts = opts;
+    pthread_mutex_init(&wk.mu, NULL);
+    pthread_cond_init(&wk.nodeDone, NULL);
+    pthread_cond_init(&wk.wake, NULL);
+
+    size_t nworkers = opts->jobs > 1 ? (size_t)opts->jobs : 0;
+    WalkWorker *workers = nworkers ? (WalkWorker *)calloc(nworkers, sizeof(WalkWorker)) : NULL;
+    pthread_t *tids = nworkers ? (pthread_t *)calloc(nworkers, sizeof(pthread_t)) : NULL;
+    wk.deques = nworkers ? (WalkDeque *)calloc(nworkers, sizeof(WalkDeque)) : NULL;
+    if (!workers || !tids || !wk.deques) nworkers = 0;
+    wk.nworkers = nworkers;
+    for (size_t t = 0; t < nworkers; ++t) pthread_mutex_init(&wk.deques[t].mu, NULL);
+
+    size_t started = 0;
+    for (size_t t = 0; t < nworkers; ++t) {
+        workers[t].walker = &wk;
+        workers[t].id = t;
+        if (pthread_create(&tids[started], NULL, walk_worker, &workers[t]) == 0) started++;
+    }
+
+    int rc = walk_emit(&wk, root);
+
+    pthread_mutex_lock(&wk.mu);
+    wk.stop = 1;
+    pthread_cond_broadcast(&wk.wake);
+    pthread_mutex_unlock(&wk.mu);
+    for (size_t t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+
+    // Каталоги, которые main взял сам, ещё лежат в очередях
+    for (size_t t = 0; t < nworkers; ++t) {
+        DirNode *n;
+        while ((n = deque_take(&wk.deques[t], 0)) != NULL) node_release(n);
+        free(wk.deques[t].items);
+        pthread_mutex_destroy(&wk.deques[t].mu);
+    }
+    free(wk.deques);
+    free(workers);
+    free(tids);
+    pthread_mutex_destroy(&wk.mu);
+    pthread_cond_destroy(&wk.nodeDone);
+    pthread_cond_destroy(&wk.wake);
+    return rc;
+}
+
+// --du: размеры поддеревьев. Каталоги обходят opts->jobs потоков (main -
+// один из них) в любом порядке. Итог каталога известен, когда готовы все
+// его подкаталоги (счётчик pending); тогда он прибавляется к родителю, а
+// узел освобождается. В памяти только каталоги в работе, (st_dev, st_ino)
+// файлов с несколькими ссылками и top-N, а не всё дерево.
+typedef struct DuNode {
+    char *path;
+    struct DuNode *parent;
+    atomic_llong blocks;         // поддерево, 512-байтные блоки
+    atomic_llong size;           // поддерево, байты
+    atomic_size_t pending;       // сам каталог и незавершённые подкаталоги
+} DuNode;
+
+typedef struct DuEntry {
+    long long blocks;
+    long long size;
+    char *path;
+} DuEntry;
+
+typedef struct InodeKey {
+    dev_t dev;
+    ino_t ino;
+} InodeKey;
+
+// Открытая адресация; ino 0 - пустой слот (такого inode не бывает)
+typedef struct InodeShard {
+    InodeKey *keys;
+    size_t len;
+    size_t cap;
+    pthread_mutex_t mu;
+} InodeShard;
+
+typedef struct DuWalker {
+    const Options *opts;
+    WalkDeque *deques;
+    size_t nworkers;
+    pthread_mutex_t mu;          // top, wakeups, stop
+    pthread_cond_t wake;
+    unsigned long wakeups;
+    int stop;                    // корень посчитан
+    DuEntry *top;                // min-куча из opts->du самых больших
+    size_t topLen;
+    InodeShard inodes[INODE_SHARDS];
+    atomic_int failed;
+} DuWalker;
+
+typedef struct DuWorker {
+    DuWalker *walker;
+    size_t id;
+} DuWorker;
+
+static uint64_t inode_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 29);
+}
+
+// 1, если (dev, ino) встретился впервые. Без памяти файл считается, как
+// будто ссылка одна.
+static int inode_set_add(DuWalker *wk, dev_t dev, ino_t ino) {
+    uint64_t h = inode_hash(dev, ino);
+    InodeShard *sh = &wk->inodes[h % INODE_SHARDS];
+    h /= INODE_SHARDS;
+    int added = 1;
+    pthread_mutex_lock(&sh->mu);
+    if ((sh->len + 1) * 10 > sh->cap * 7) {
+        size_t newCap = sh->cap ? sh->cap * 2 : 1024;
+        InodeKey *keys = (InodeKey *)calloc(newCap, sizeof(InodeKey));
+        if (keys) {
+            for (size_t i = 0; i < sh->cap; ++i) {
+                if (sh->keys[i].ino == 0) continue;
+                size_t j = (inode_hash(sh->keys[i].dev, sh->keys[i].ino) / INODE_SHARDS) & (newCap - 1);
+                while (keys[j].ino != 0) j = (j + 1) & (newCap - 1);
+                keys[j] = sh->keys[i];
+            }
+            free(sh->keys);
+            sh->keys = keys;
+            sh->cap = newCap;
+        }
+    }
+    if ((sh->len + 1) * 10 <= sh->cap * 9) {
+        size_t j = h & (sh->cap - 1);
+        while (sh->keys[j].ino != 0 && !(sh->keys[j].ino == ino && sh->keys[j].dev == dev)) {
+            j = (j + 1) & (sh->cap - 1);
+        }
+        if (sh->keys[j].ino != 0) {
+            added = 0;
+        } else {
+            sh->keys[j].dev = dev;
+            sh->keys[j].ino = ino;
+            sh->len++;
+        }
+    }
+    pthread_mutex_unlock(&sh->mu);
+    return added;
+}
+
+// a больше b: по блокам, при равенстве - раньше по пути
+static int du_bigger(const DuEntry *a, const DuEntry *b) {
+    if (a->blocks != b->blocks) return a->blocks > b->blocks;
+    return strcmp(a->path, b->path) < 0;
+}
+
+static void du_sift_down(DuEntry *h, size_t n, size_t i) {
+    for (;;) {
+        size_t m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && du_bigger(&h[m], &h[l])) m = l;
+        if (r < n && du_bigger(&h[m], &h[r])) m = r;
+        if (m == i) return;
+        DuEntry t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+// Предлагает каталог в top-N
+static void du_offer(DuWalker *wk, long long blocks, long long size, const char *path) {
+    DuEntry cand = { blocks, size, (char *)path };
+    size_t n = (size_t)wk->opts->du;
+    pthread_mutex_lock(&wk->mu);
+    if (wk->topLen < n || du_bigger(&cand, &wk->top[0])) {
+        char *copy = strdup(path);
+        if (copy) {
+            cand.path = copy;
+            if (wk->topLen < n) {
+                size_t i = wk->topLen++;
+                wk->top[i] = cand;
+                while (i > 0 && du_bigger(&wk->top[(i - 1) / 2], &wk->top[i])) {
+                    DuEntry t = wk->top[i];
+                    wk->top[i] = wk->top[(i - 1) / 2];
+                    wk->top[(i - 1) / 2] = t;
+                    i = (i - 1) / 2;
+                }
+            } else {
+                free(wk->top[0].path);
+                wk->top[0] = cand;
+                du_sift_down(wk->top, wk->topLen, 0);
+            }
+        }
+    }
+    pthread_mutex_unlock(&wk->mu);
+}
+
+static DuNode *du_node_new(char *path, DuNode *parent) {
+    DuNode *n = (DuNode *)malloc(sizeof(DuNode));
+    if (!n) return NULL;
+    n->path = path;
+    n->parent = parent;
+    atomic_init(&n->blocks, 0);
+    atomic_init(&n->size, 0);
+    atomic_init(&n->pending, 1);
+    return n;
+}
 
+// Снимает с n одну отметку pending. Последняя завершает каталог: итог
+// идёт в top-N и родителю, и так вверх, пока у кого-то остались дети.
+static void du_complete(DuWalker *wk, DuNode *n) {
+    while (n && atomic_fetch_sub(&n->pending, 1) == 1) {
+        long long blocks = atomic_load(&n->blocks);
+        long long size = atomic_load(&n->size);
+        du_offer(wk, blocks, size, n->path);
+        DuNode *parent = n->parent;
+        if (parent) {
+            atomic_fetch_add(&parent->blocks, blocks);
+            atomic_fetch_add(&parent->size, size);
+        } else {
+            pthread_mutex_lock(&wk->mu);
+            wk->stop = 1;
+            pthread_cond_broadcast(&wk->wake);
+            pthread_mutex_unlock(&wk->mu);
+        }
+        free(n->path);
+        free(n);
+        n = parent;
+    }
+}
+
+// Считает файлы каталога n, подкаталоги ставит в dq. buf - буфер
+// getdents64 потока.
+static void du_dir(DuWalker *wk, DuNode *n, WalkDeque *dq, char *buf) {
+    long long blocks = 0, size = 0;
+    int pushed = 0;
+    int dfd = open(n->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0) {
+        fprintf(stderr, "myls: cannot access '%s': %s\n", n->path, strerror(errno));
+        atomic_store(&wk->failed, 1);
+    } else {
+        struct stat st;
+        if (fstat(dfd, &st) == 0) {
+            blocks += st.st_blocks;
+            size += st.st_size;
+        }
+        Listing l;
+        memset(&l, 0, sizeof(l));
+        for (;;) {
+            int more = read_dents(dfd, n->path, buf, wk->opts, &l, stderr);
+            if (more < 0) atomic_store(&wk->failed, 1);
+            stat_entries(dfd, n->path, wk->opts, &l, stderr);
+
+            for (size_t i = 0; i < l.len; ++i) {
+                const EntryInfo *e = &l.entries[i];
+                const char *name = entry_name(&l, e);
+                if (S_ISDIR(e->mode)) {
+                    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+                    char *path = join_path(n->path, name);
+                    DuNode *c = path ? du_node_new(path, n) : NULL;
+                    atomic_fetch_add(&n->pending, 1);
+                    if (!c || deque_push(dq, c) != 0) {
+                        fprintf(stderr, "malloc: %s\n", strerror(ENOMEM));
+                        atomic_store(&wk->failed, 1);
+                        atomic_fetch_sub(&n->pending, 1);
+                        if (c) free(c);
+                        free(path);
+                        continue;
+                    }
+                    pushed = 1;
+                } else if (e->nlink <= 1 || inode_set_add(wk, e->dev, e->ino)) {
+                    blocks += e->blocks;
+                    size += e->size;
+                }
+            }
+            listing_reset(&l);
+            if (more <= 0) break;
+        }
+        listing_free(&l);
+        close(dfd);
+    }
+
+    atomic_fetch_add(&n->blocks, blocks);
+    atomic_fetch_add(&n->size, size);
+    if (pushed) {
+        pthread_mutex_lock(&wk->mu);
+        wk->wakeups++;
+        pthread_cond_broadcast(&wk->wake);
+        pthread_mutex_unlock(&wk->mu);
+    }
+    du_complete(wk, n);
+}
+
+static void *du_worker(void *arg) {
+    DuWorker *w = (DuWorker *)arg;
+    DuWalker *wk = w->walker;
+    char *buf = (char *)malloc(DENTS_BUF_SIZE);
+    if (!buf) return NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&wk->mu);
+        unsigned long seen = wk->wakeups;
+        int stop = wk->stop;
+        pthread_mutex_unlock(&wk->mu);
+        if (stop) break;
+
+        DuNode *n = deque_take(&wk->deques[w->id], 0);
+        for (size_t k = 1; !n && k < wk->nworkers; ++k) {
+            n = deque_take(&wk->deques[(w->id + k) % wk->nworkers], 1);
+        }
+        if (!n) {
+            pthread_mutex_lock(&wk->mu);
+            while (!wk->stop && wk->wakeups == seen) pthread_cond_wait(&wk->wake, &wk->mu);
+            pthread_mutex_unlock(&wk->mu);
+            continue;
+        }
+        du_dir(wk, n, &wk->deques[w->id], buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Считает дерево path; -1, если main не смог начать обход
+static int du_tree(DuWalker *wk, const char *path) {
+    char *rootPath = strdup(path);
+    DuNode *root = rootPath ? du_node_new(rootPath, NULL) : NULL;
+    if (!root || deque_push(&wk->deques[0], root) != 0) {
+        free(rootPath);
+        free(root);
+        return -1;
+    }
+    wk->stop = 0;
+
+    DuWorker *workers = (DuWorker *)calloc(wk->nworkers, sizeof(DuWorker));
+    pthread_t *tids = (pthread_t *)calloc(wk->nworkers, sizeof(pthread_t));
+    size_t started = 0;
+    for (size_t t = 0; t < wk->nworkers; ++t) {
+        if (!workers) break;
+        workers[t].walker = wk;
+        workers[t].id = t;
+        if (t > 0 && tids && pthread_create(&tids[started], NULL, du_worker, &workers[t]) == 0) started++;
+    }
+    DuWorker self = { wk, 0 };
+    du_worker(&self);
+    for (size_t t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+    free(workers);
+    free(tids);
     return 0;
 }
 
+// --du: для каждого аргумента - обход, потом общий top-N по убыванию:
+// "КиБ<TAB>байт<TAB>путь". Жёсткие ссылки считаются один раз на весь запуск.
+static int disk_usage(const Listing *args, const Options *opts) {
+    DuWalker wk;
+    memset(&wk, 0, sizeof(wk));
+    wk.opts = opts;
+    wk.nworkers = (size_t)opts->jobs;
+    pthread_mutex_init(&wk.mu, NULL);
+    pthread_cond_init(&wk.wake, NULL);
+    atomic_init(&wk.failed, 0);
+    for (size_t i = 0; i < INODE_SHARDS; ++i) pthread_mutex_init(&wk.inodes[i].mu, NULL);
+    wk.top = (DuEntry *)calloc((size_t)opts->du, sizeof(DuEntry));
+    wk.deques = (WalkDeque *)calloc(wk.nworkers, sizeof(WalkDeque));
+    int rc = 0;
+    if (!wk.top || !wk.deques) {
+        perror("malloc");
+        rc = 1;
+        wk.nworkers = 0;
+    }
+    for (size_t t = 0; t < wk.nworkers; ++t) pthread_mutex_init(&wk.deques[t].mu, NULL);
+
+    for (size_t i = 0; rc == 0 && i < args->len; ++i) {
+        const EntryInfo *e = &args->entries[i];
+        const char *path = entry_name(args, e);
+        if (e->statErr != 0) {
+            fprintf(stderr, "myls: cannot access '%s': %s\n", path, strerror(e->statErr));
+            rc = 1;
+        } else if (S_ISDIR(e->mode)) {
+            if (du_tree(&wk, path) != 0) {
+                perror("malloc");
+                rc = 1;
+            }
+        } else if (e->nlink <= 1 || inode_set_add(&wk, e->dev, e->ino)) {
+            du_offer(&wk, (long long)e->blocks, (long long)e->size, path);
+        }
+    }
+    if (atomic_load(&wk.failed)) rc = 1;
+
+    // Куча -> по убыванию
+    for (size_t n = wk.topLen; n > 1; --n) {
+        DuEntry t = wk.top[0];
+        wk.top[0] = wk.top[n - 1];
+        wk.top[n - 1] = t;
+        du_sift_down(wk.top, n - 1, 0);
+    }
+    for (size_t i = 0; i < wk.topLen; ++i) {
+        out_uint(&stdoutBuf, (unsigned long long)(wk.top[i].blocks + 1) / 2, 0);
+        out_char(&stdoutBuf, '\t');
+        out_uint(&stdoutBuf, (unsigned long long)wk.top[i].size, 0);
+        out_char(&stdoutBuf, '\t');
+        out_str(&stdoutBuf, wk.top[i].path);
+        out_char(&stdoutBuf, eol);
+        free(wk.top[i].path);
+    }
+
+    for (size_t t = 0; t < wk.nworkers; ++t) {
+        free(wk.deques[t].items);
+        pthread_mutex_destroy(&wk.deques[t].mu);
+    }
+    for (size_t i = 0; i < INODE_SHARDS; ++i) {
+        free(wk.inodes[i].keys);
+        pthread_mutex_destroy(&wk.inodes[i].mu);
+    }
+    free(wk.deques);
+    free(wk.top);
+    pthread_mutex_destroy(&wk.mu);
+    pthread_cond_destroy(&wk.wake);
+    return rc;
+}
+
 static int list_file(const char *path, const Options *opts) {
     struct stat st;
     if (lstat(path, &st) != 0) {
         fprintf(stderr, "myls: cannot access '%s': %s\n", path, strerror(errno));
         return 1;
     }
-    EntryInfo e;
-    memset(&e, 0, sizeof(e));
+    Listing l;
+    memset(&l, 0, sizeof(l));
     const char *slash = strrchr(path, '/');
-    e.name = strdup(slash ? slash + 1 : path);
-    e.fullPath = strdup(path);
-    e.st = st;
-    e.isSymlink = S_ISLNK(st.st_mode);
+    const char *name = slash ? slash + 1 : path;
+    EntryInfo *e = listing_add(&l, name, strlen(name));
+    if (!e) {
+        perror("malloc");
+        listing_free(&l);
+        return 1;
+    }
+    entry_set_stat(e, &st);
+    if ((opts->longList || opts->format != FORMAT_TEXT) && S_ISLNK(st.st_mode)) {
+        read_link_target(&l, e, AT_FDCWD, path);
+    }
 
     int rc = 0;
-    if (opts->longList) {
+    if (opts->format != FORMAT_TEXT) {
+        print_json_entry(&stdoutBuf, opts, &l, e, path, (size_t)(name - path));
+    } else if (opts->longList) {
         Widths w = (Widths){0};
 
         w.w_links = num_digits_unsigned((unsigned long long)st.st_nlink);
-        struct passwd *pw = getpwuid(st.st_uid);
-        struct group *gr = getgrgid(st.st_gid);
-        w.w_user = (int)strlen(pw ? pw->pw_name : "?");
-        w.w_group = (int)strlen(gr ? gr->gr_name : "?");
+        w.w_user = user_of(st.st_uid)->len;
+        w.w_group = group_of(st.st_gid)->len;
         w.w_size = num_digits_unsigned((unsigned long long)st.st_size);
-        print_long_entry(&e, w.w_links, w.w_user, w.w_group, w.w_size);
+        print_long_entry(&stdoutBuf, &l, e, w.w_links, w.w_user, w.w_group, w.w_size);
     } else {
-        print_name_with_color(&e);
-        putchar('\n');
+        print_name_with_color(&stdoutBuf, name, st.st_mode);
+        out_char(&stdoutBuf, eol);
+    }
+
+    listing_free(&l);
+    return rc;
+}
+
+// Аргументы-файлы, потом аргументы-каталоги
+static int list_arguments(const Listing *args, const Options *opts) {
+    int rc = 0;
+
+    // Pass 1: файлы
+    int hasFiles = 0, hasDirs = 0;
+    for (size_t i = 0; i < args->len; ++i) {
+        const EntryInfo *e = &args->entries[i];
+        const char *path = entry_name(args, e);
+        if (e->statErr != 0) {
+            fprintf(stderr, "myls: cannot access '%s': %s\n", path, strerror(e->statErr));
+            rc = 1;
+            continue;
+        }
+        if (S_ISDIR(e->mode)) {
+            hasDirs = 1;
+        } else {
+            hasFiles = 1;
+            rc |= list_file(path, opts);
+            if (stdoutTty) out_flush(&stdoutBuf);
+        }
+    }
+
+    // Пустая строка между файлами и директориями, если есть и то, и другое
+    int text = opts->format == FORMAT_TEXT;
+    if (text && hasFiles && hasDirs) out_char(&stdoutBuf, '\n');
+
+    // Pass 2: директории
+    int multiple = (args->len > 1);
+    int printedHeaderBefore = 0;
+    for (size_t i = 0; i < args->len; ++i) {
+        const EntryInfo *e = &args->entries[i];
+        const char *path = entry_name(args, e);
+        if (e->statErr != 0) continue;
+        if (S_ISDIR(e->mode)) {
+            int header = multiple || printedHeaderBefore;
+            if (opts->recursive) rc |= list_tree(path, opts);
+            else rc |= list_directory(path, opts, header || multiple, &stdoutBuf, stderr, NULL);
+            if (stdoutTty) out_flush(&stdoutBuf);
+            if (text && i < args->len - 1) out_char(&stdoutBuf, '\n');
+            printedHeaderBefore = 1;
+        }
     }
 
-    free_entry(&e);
     return rc;
 }
 
+// Дописывает stdout; код выхода с учётом ошибки записи
+static int finish_output(const Options *opts, int exitCode) {
+    if (opts->format == FORMAT_JSON) out_str(&stdoutBuf, stdoutBuf.records ? "\n]\n" : "]\n");
+    out_flush(&stdoutBuf);
+    out_free(&stdoutBuf);
+    if (stdoutBuf.err) {
+        fprintf(stderr, "myls: write error: %s\n", strerror(stdoutBuf.err));
+        exitCode = 1;
+    }
+    return exitCode ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     Options opts;
     memset(&opts, 0, sizeof(opts));
+    opts.color = -1;
+    opts.jobs = DEFAULT_STAT_JOBS;
 
     char **paths = NULL;
     int pathsCount = 0;
@@ -318,12 +1989,61 @@ int main(int argc, char **argv) {
             }
             break;
         }
+        if (strcmp(arg, "--du") == 0 || strncmp(arg, "--du=", 5) == 0) {
+            char *endp = NULL;
+            long n = arg[4] == '=' ? strtol(arg + 5, &endp, 10) : DU_DEFAULT_TOP;
+            if (arg[4] == '=' && (*endp != '\0' || endp == arg + 5 || n < 1 || n > INT_MAX)) {
+                fprintf(stderr, "myls: invalid argument '%s' for '--du'\n", arg + 5);
+                print_usage(argv[0]);
+                free(paths);
+                return 1;
+            }
+            opts.du = (int)n;
+            continue;
+        }
+        if (strcmp(arg, "--json") == 0 || strcmp(arg, "--ndjson") == 0) {
+            opts.format = arg[2] == 'j' ? FORMAT_JSON : FORMAT_NDJSON;
+            continue;
+        }
+        if (strcmp(arg, "--color") == 0 || strncmp(arg, "--color=", 8) == 0) {
+            const char *when = arg[7] == '=' ? arg + 8 : "always";
+            if (strcmp(when, "always") == 0) opts.color = 1;
+            else if (strcmp(when, "never") == 0) opts.color = 0;
+            else if (strcmp(when, "auto") == 0) opts.color = -1;
+            else {
+                fprintf(stderr, "myls: invalid argument '%s' for '--color'\n", when);
+                print_usage(argv[0]);
+                free(paths);
+                return 1;
+            }
+            continue;
+        }
         if (arg[0] == '-' && arg[1] != '\0') {
             // Опции пачкой: -la == -l -a
             for (int k = 1; arg[k] != '\0'; ++k) {
                 char c = arg[k];
                 if (c == 'l') opts.longList = 1;
                 else if (c == 'a') opts.showAll = 1;
+                else if (c == 'n') opts.numericIds = opts.longList = 1;
+                else if (c == 'R') opts.recursive = 1;
+                else if (c == 't') opts.sortBy = SORT_TIME;
+                else if (c == 'S') opts.sortBy = SORT_SIZE;
+                else if (c == 'U') opts.sortBy = SORT_NONE;
+                else if (c == 'r') opts.reverse = 1;
+                else if (c == '0') opts.zero = 1;
+                else if (c == 'j') {
+                    const char *val = arg[k + 1] != '\0' ? arg + k + 1 : (i + 1 < argc ? argv[++i] : NULL);
+                    char *endp = NULL;
+                    long n = val ? strtol(val, &endp, 10) : 0;
+                    if (!val || *endp != '\0' || n < 1 || n > 64) {
+                        fprintf(stderr, "myls: invalid number of jobs: '%s'\n", val ? val : "");
+                        print_usage(argv[0]);
+                        free(paths);
+                        return 1;
+                    }
+                    opts.jobs = (int)n;
+                    break;
+                }
                 else {
                     fprintf(stderr, "myls: invalid option -- '%c'\n", c);
                     print_usage(argv[0]);
@@ -344,63 +2064,63 @@ int main(int argc, char **argv) {
     }
 
     int exitCode = 0;
+    numericIds = opts.numericIds;
+    const char *collate = setlocale(LC_COLLATE, "");
+    collateBytes = !collate || strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+    stdoutTty = isatty(STDOUT_FILENO);
+    useColor = opts.color < 0 ? stdoutTty : opts.color;
+    if (opts.zero) eol = '\0';
+    if (opts.du) {
+        opts.showAll = 1;    // скрытые файлы тоже занимают место
+        opts.format = FORMAT_TEXT;
+    }
+    if (opts.format == FORMAT_JSON) out_char(&stdoutBuf, '[');
 
+    if (pathsCount <= 0 && opts.du) {
+        char **tmp = (char **)realloc(paths, sizeof(char *));
+        if (!tmp) { perror("realloc"); free(paths); return 1; }
+        paths = tmp;
+        pathsCap = 1;
+        paths[pathsCount++] = ".";
+    }
     if (pathsCount <= 0) {
-        exitCode |= list_directory(".", &opts, 0);
+        if (opts.recursive) exitCode |= list_tree(".", &opts);
+        else exitCode |= list_directory(".", &opts, 0, &stdoutBuf, stderr, NULL);
         free(paths);
-        return exitCode ? 1 : 0;
+        free_id_cache(&userCache);
+        free_id_cache(&groupCache);
+        return finish_output(&opts, exitCode);
     }
 
-    // Отсортируем пути альфавитно
+    // Аргументы сортируются так же, как записи каталога. Ошибка lstat
+    // запоминается и печатается в первом проходе.
+    Listing args;
+    memset(&args, 0, sizeof(args));
     for (int i = 0; i < pathsCount; ++i) {
-        for (int j = i + 1; j < pathsCount; ++j) {
-            if (strcoll(paths[i], paths[j]) > 0) {
-                char *tmp = paths[i];
-                paths[i] = paths[j];
-                paths[j] = tmp;
-            }
+        EntryInfo *e = listing_add(&args, paths[i], strlen(paths[i]));
+        if (!e) {
+            perror("malloc");
+            listing_free(&args);
+            free(paths);
+            return 1;
         }
-    }
-
-    // Pass 1: файлы
-    for (int i = 0; i < pathsCount; ++i) {
         struct stat st;
-        if (lstat(paths[i], &st) != 0) {
-            fprintf(stderr, "myls: cannot access '%s': %s\n", paths[i], strerror(errno));
-            exitCode = 1;
-            continue;
-        }
-        if (!S_ISDIR(st.st_mode)) {
-            exitCode |= list_file(paths[i], &opts);
-        }
+        if (lstat(paths[i], &st) != 0) e->statErr = errno;
+        else entry_set_stat(e, &st);
     }
-
-    // Пустая строка между файлами и директориями, если есть и то, и другое
-    int hasFiles = 0, hasDirs = 0;
-    for (int i = 0; i < pathsCount; ++i) {
-        struct stat st;
-        if (lstat(paths[i], &st) == 0) {
-            if (S_ISDIR(st.st_mode)) hasDirs = 1; else hasFiles = 1;
-        }
+    if (sort_listing(&args, &opts) != 0) {
+        perror("malloc");
+        exitCode = 1;
     }
-    if (hasFiles && hasDirs) puts("");
 
-    // Pass 2: директории
-    int multiple = (pathsCount > 1);
-    int printedHeaderBefore = 0;
-    for (int i = 0; i < pathsCount; ++i) {
-        struct stat st;
-        if (lstat(paths[i], &st) != 0) continue;
-        if (S_ISDIR(st.st_mode)) {
-            int header = multiple || printedHeaderBefore;
-            exitCode |= list_directory(paths[i], &opts, header || multiple);
-            if (i < pathsCount - 1) puts("");
-            printedHeaderBefore = 1;
-        }
-    }
+    if (opts.du) exitCode |= disk_usage(&args, &opts);
+    else exitCode |= list_arguments(&args, &opts);
 
+    listing_free(&args);
     free(paths);
-    return exitCode ? 1 : 0;
+    free_id_cache(&userCache);
+    free_id_cache(&groupCache);
+    return finish_output(&opts, exitCode);
 }
 
 
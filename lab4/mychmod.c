@@ -1,6 +1,7 @@
 // mychmod.c
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // d_type
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -8,15 +9,25 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+// Потоков для -R по умолчанию: chmod и stat ждут файловую систему, не CPU
+#define DEFAULT_JOBS 8
+#define MAX_JOBS 64
 
 void usage(const char *prog) {
     fprintf(stderr,
-        "Использование: %s MODE FILE\n"
+        "Использование: %s [-R] [-j N] MODE FILE...\n"
+        "  -R    рекурсивно для каталогов (символические ссылки внутри не трогаются)\n"
+        "  -j N  потоков для обхода при -R (по умолчанию %d)\n"
         "MODE может быть:\n"
         "  числовой oktal (например 766 или 0755)\n"
-        "  символьный (например u+r, g-w, a+x, ug+rw, uga=rwx)\n"
+        "  символьный (например u+r, g-w, a+X, ug+rw, uga=rwx, u+s, +t, g=u, u+r-w)\n"
         "  несколько символьных выражений через запятую: u+r,g-w\n",
-        prog);
+        prog, DEFAULT_JOBS);
 }
 
 int is_octal_string(const char *s) {
@@ -35,136 +46,371 @@ mode_t parse_octal(const char *s) {
     return (mode_t) val;
 }
 
-int apply_clause(mode_t *mode, const char *clause, mode_t orig_mode) {
-    // clause: [ugoa]*[+-=][rwx]+
-    // возвращает 0 при успехе, -1 при ошибке
-    const char *p = clause;
-    int who_mask = 0;
-    // соберём who
-    while (*p && (*p == 'u' || *p == 'g' || *p == 'o' || *p == 'a')) {
-        if (*p == 'u') who_mask |= 0700;
-        else if (*p == 'g') who_mask |= 0070;
-        else if (*p == 'o') who_mask |= 0007;
-        else if (*p == 'a') who_mask |= (0700|0070|0007);
-        p++;
+// Символьный MODE разбирается один раз в программу ModeProgram, которая
+// потом применяется к каждому файлу без разбора строки.
+//
+// Грамматика как у chmod: [ugoa]*([-+=]([rwxXst]*|[ugo]))+ через запятую.
+// Без who действует 'a', но биты из umask не ставятся. X - x, если это
+// каталог или x уже есть у кого-нибудь; s - setuid/setgid, t - sticky;
+// u/g/o после оператора - права этого класса на текущий момент (g=u). У
+// каталогов '=' не сбрасывает setuid/setgid, если s не упомянут.
+enum { OP_PLAIN, OP_X_IF_ANY_X, OP_COPY };
+
+typedef struct {
+    char op;                // '+', '-', '='
+    char flag;              // OP_*
+    char mentions_s;        // в правах есть 's'
+    mode_t who;             // биты u/g/o/a, 0 если who не указан
+    mode_t value;           // биты прав; для OP_COPY - класс-источник
+} ModeOp;
+
+typedef struct {
+    // Если нет X и копирования, вся программа сводится к
+    // new = (cur & and_mask) | or_mask, отдельно для каталогов ([1]) и
+    // остальных ([0]); тогда ops == NULL.
+    mode_t and_mask[2];
+    mode_t or_mask[2];
+    ModeOp *ops;
+    size_t nops;
+    mode_t umask_bits;
+} ModeProgram;
+
+// Биты, которые операция меняет: who или всё, кроме umask, и без
+// setuid/setgid каталога, если s не упомянут
+mode_t op_value(const ModeProgram *prog, const ModeOp *op, mode_t value, int dir, mode_t *omit) {
+    *omit = dir && !op->mentions_s ? (S_ISUID | S_ISGID) : 0;
+    return value & (op->who ? op->who : ~prog->umask_bits) & ~*omit & 07777;
+}
+
+mode_t apply_op(const ModeProgram *prog, const ModeOp *op, mode_t mode, int dir) {
+    mode_t value = op->value;
+    if (op->flag == OP_COPY) {
+        mode_t src = value & mode;
+        value = ((src & 0444) ? 0444 : 0) | ((src & 0222) ? 0222 : 0) | ((src & 0111) ? 0111 : 0);
+    } else if (op->flag == OP_X_IF_ANY_X && (dir || (mode & 0111))) {
+        value |= 0111;
     }
-    if (who_mask == 0) {
-        // по умолчанию 'a' (как в chmod)
-        who_mask = (0700|0070|0007);
+
+    mode_t omit;
+    value = op_value(prog, op, value, dir, &omit);
+    if (op->op == '+') return mode | value;
+    if (op->op == '-') return mode & ~value;
+    mode_t preserved = (op->who ? ~op->who : 0) | omit;
+    return (mode & preserved) | value;
+}
+
+// Разбирает символьный MODE в prog->ops. 1 - можно свернуть в маски,
+// 0 - нужен список операций (X или копирование), -1 - MODE неверный.
+int parse_symbolic(const char *mode_str, ModeProgram *prog) {
+    const char *p = mode_str;
+    int simple = 1;
+    for (;;) {
+        while (isspace((unsigned char)*p)) p++;
+        mode_t who = 0;
+        for (; *p == 'u' || *p == 'g' || *p == 'o' || *p == 'a'; ++p) {
+            if (*p == 'u') who |= S_ISUID | S_IRWXU;
+            else if (*p == 'g') who |= S_ISGID | S_IRWXG;
+            else if (*p == 'o') who |= S_ISVTX | S_IRWXO;
+            else who |= 07777;
+        }
+        if (*p != '+' && *p != '-' && *p != '=') return -1;
+        while (*p == '+' || *p == '-' || *p == '=') {
+            ModeOp *op = &prog->ops[prog->nops++];
+            memset(op, 0, sizeof(*op));
+            op->op = *p++;
+            op->who = who;
+            if (*p == 'u' || *p == 'g' || *p == 'o') {
+                op->flag = OP_COPY;
+                op->value = *p == 'u' ? S_IRWXU : *p == 'g' ? S_IRWXG : S_IRWXO;
+                simple = 0;
+                p++;
+                continue;
+            }
+            for (; *p && strchr("rwxXst", *p); ++p) {
+                if (*p == 'r') op->value |= 0444;
+                else if (*p == 'w') op->value |= 0222;
+                else if (*p == 'x') op->value |= 0111;
+                else if (*p == 's') { op->value |= S_ISUID | S_ISGID; op->mentions_s = 1; }
+                else if (*p == 't') op->value |= S_ISVTX;
+                else { op->flag = OP_X_IF_ANY_X; simple = 0; }
+            }
+        }
+        if (*p == '\0') return simple;
+        if (*p++ != ',') return -1;
     }
+}
 
-    if (!*p) return -1;
-    char op = *p++;
-    if (!(op == '+' || op == '-' || op == '=')) return -1;
+// 0 при успехе, -1 если MODE неверный
+int compile_mode(const char *mode_str, ModeProgram *prog) {
+    memset(prog, 0, sizeof(*prog));
+    if (is_octal_string(mode_str)) {
+        // числовой режим. Если длина строки == 3 — считаем, что пользователь
+        // не указывает спецбиты, и они сохраняются; если >= 4 — берём всё,
+        // что дали (включая setuid, setgid, sticky).
+        mode_t parsed = parse_octal(mode_str);
+        int three = strlen(mode_str) == 3;
+        for (int d = 0; d < 2; ++d) {
+            prog->and_mask[d] = three ? 07000 : 0;
+            prog->or_mask[d] = parsed & (three ? 0777 : 07777);
+        }
+        return 0;
+    }
 
-    if (!*p) return -1;
+    // операций не больше, чем символов
+    prog->ops = malloc((strlen(mode_str) + 1) * sizeof(ModeOp));
+    if (!prog->ops) return -1;
+    mode_t um = umask(0);
+    umask(um);
+    prog->umask_bits = um;
 
-    int perm_bits_u = 0, perm_bits_g = 0, perm_bits_o = 0;
-    // обработаем набор прав r,w,x
-    while (*p) {
-        if (*p == ',') { // если встретили запятую - конец этого clause (парсинг на уровне вызова)
-            break;
+    int simple = parse_symbolic(mode_str, prog);
+    if (simple < 0) {
+        free(prog->ops);
+        prog->ops = NULL;
+        return -1;
+    }
+    if (simple) {
+        // Свёртка: каждая операция - это (m & A) | O -> (m & A') | O'
+        for (int d = 0; d < 2; ++d) {
+            mode_t and_mask = 07777, or_mask = 0;
+            for (size_t i = 0; i < prog->nops; ++i) {
+                const ModeOp *op = &prog->ops[i];
+                mode_t omit;
+                mode_t value = op_value(prog, op, op->value, d, &omit);
+                if (op->op == '+') {
+                    or_mask |= value;
+                } else if (op->op == '-') {
+                    and_mask &= ~value;
+                    or_mask &= ~value;
+                } else {
+                    mode_t preserved = (op->who ? ~op->who : 0) | omit;
+                    and_mask &= preserved;
+                    or_mask = (or_mask & preserved) | value;
+                }
+            }
+            prog->and_mask[d] = and_mask;
+            prog->or_mask[d] = or_mask;
         }
-        char c = *p++;
-        if (c == 'r') {
-            perm_bits_u |= 0400; perm_bits_g |= 0040; perm_bits_o |= 0004;
-        } else if (c == 'w') {
-            perm_bits_u |= 0200; perm_bits_g |= 0020; perm_bits_o |= 0002;
-        } else if (c == 'x') {
-            perm_bits_u |= 0100; perm_bits_g |= 0010; perm_bits_o |= 0001;
-        } else {
-            // неподдерживаемый символ
+        free(prog->ops);
+        prog->ops = NULL;
+        prog->nops = 0;
+    }
+    return 0;
+}
+
+// Новые биты режима (07777) для файла с режимом cur
+mode_t run_mode(const ModeProgram *prog, mode_t cur) {
+    int dir = S_ISDIR(cur) ? 1 : 0;
+    if (!prog->ops) return ((cur & prog->and_mask[dir]) | prog->or_mask[dir]) & 07777;
+    mode_t mode = cur & 07777;
+    for (size_t i = 0; i < prog->nops; ++i) mode = apply_op(prog, &prog->ops[i], mode, dir);
+    return mode;
+}
+
+// Каталоги, ждущие обхода при -R. Общий стек: поток, закончивший каталог,
+// берёт последний добавленный, так что обход близок к обходу в глубину и
+// очередь не разрастается до ширины всего дерева.
+typedef struct {
+    char **paths;
+    size_t len;
+    size_t cap;
+    size_t active;          // потоков, занятых каталогом
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} WorkStack;
+
+static WorkStack work = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static pthread_mutex_t report_mu = PTHREAD_MUTEX_INITIALIZER;
+static int failed;
+static ModeProgram program;
+
+// Сообщение об ошибке из потока обхода; код выхода станет ненулевым
+void report(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&report_mu);
+    vfprintf(stderr, fmt, ap);
+    failed = 1;
+    pthread_mutex_unlock(&report_mu);
+    va_end(ap);
+}
+
+int work_push(char *path) {
+    pthread_mutex_lock(&work.mu);
+    if (work.len == work.cap) {
+        size_t new_cap = work.cap ? work.cap * 2 : 256;
+        char **tmp = realloc(work.paths, new_cap * sizeof(char *));
+        if (!tmp) {
+            pthread_mutex_unlock(&work.mu);
             return -1;
         }
+        work.paths = tmp;
+        work.cap = new_cap;
     }
+    work.paths[work.len++] = path;
+    pthread_cond_signal(&work.cv);
+    pthread_mutex_unlock(&work.mu);
+    return 0;
+}
+
+// "dir/name", слэш не удваивается
+char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = dlen > 0 && dir[dlen - 1] != '/';
+    char *p = malloc(dlen + slash + nlen + 1);
+    if (!p) return NULL;
+    memcpy(p, dir, dlen);
+    if (slash) p[dlen] = '/';
+    memcpy(p + dlen + slash, name, nlen + 1);
+    return p;
+}
 
-    // соберём итоговую маску прав для применения (по who)
-    mode_t add_mask = 0;
-    if (who_mask & 0700) add_mask |= (perm_bits_u & 0700);
-    if (who_mask & 0070) add_mask |= (perm_bits_g & 0070);
-    if (who_mask & 0007) add_mask |= (perm_bits_o & 0007);
-
-    if (op == '+') {
-        *mode |= add_mask;
-    } else if (op == '-') {
-        *mode &= ~add_mask;
-    } else if (op == '=') {
-        // для '=' сначала очистим соответствующие биты у/g/o, затем выставим только add_mask (для тех кто указаны)
-        if (who_mask & 0700) *mode &= ~0700;
-        if (who_mask & 0070) *mode &= ~0070;
-        if (who_mask & 0007) *mode &= ~0007;
-        *mode |= add_mask;
+// Меняет режим всех записей каталога path относительно его fd и кладёт
+// подкаталоги в work. Каталог меняется до того, как в него заходят (как в
+// chmod -R). Символические ссылки пропускаются: chmod меняет не их, а цель.
+void process_dir(const char *path) {
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = dfd >= 0 ? fdopendir(dfd) : NULL;
+    if (!dir) {
+        report("Ошибка opendir('%s'): %s\n", path, strerror(errno));
+        if (dfd >= 0) close(dfd);
+        return;
     }
 
-    return 0;
+    struct dirent *de;
+    while ((errno = 0, de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (de->d_type == DT_LNK) continue;
+
+        struct stat st;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            char *full = join_path(path, name);
+            report("Ошибка stat('%s'): %s\n", full ? full : name, strerror(errno));
+            free(full);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode)) continue;
+
+        mode_t new_mode = run_mode(&program, st.st_mode);
+        if (new_mode != (st.st_mode & 07777) && fchmodat(dfd, name, new_mode, 0) != 0) {
+            char *full = join_path(path, name);
+            report("Ошибка chmod('%s', %o): %s\n", full ? full : name, (unsigned)new_mode, strerror(errno));
+            free(full);
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            char *sub = join_path(path, name);
+            if (!sub || work_push(sub) != 0) {
+                report("Ошибка обхода '%s': %s\n", path, strerror(ENOMEM));
+                free(sub);
+            }
+        }
+    }
+    if (errno != 0) report("Ошибка readdir('%s'): %s\n", path, strerror(errno));
+    closedir(dir);
 }
 
-int apply_symbolic(mode_t *mode, const char *spec, mode_t orig_mode) {
-    // spec может содержать несколько clause разделённых запятыми
-    char *copy = strdup(spec);
-    if (!copy) return -1;
-    char *saveptr = NULL;
-    char *token = strtok_r(copy, ",", &saveptr);
-    int res = 0;
-    while (token) {
-        // trim spaces
-        while (*token && isspace((unsigned char)*token)) token++;
-        if (*token == '\0') { token = strtok_r(NULL, ",", &saveptr); continue; }
-        if (apply_clause(mode, token, orig_mode) != 0) {
-            res = -1;
-            break;
+void *walk_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&work.mu);
+        while (work.len == 0 && work.active > 0) pthread_cond_wait(&work.cv, &work.mu);
+        if (work.len == 0) {
+            // ни работы, ни тех, кто мог бы её добавить
+            pthread_cond_broadcast(&work.cv);
+            pthread_mutex_unlock(&work.mu);
+            return NULL;
         }
-        token = strtok_r(NULL, ",", &saveptr);
+        char *path = work.paths[--work.len];
+        work.active++;
+        pthread_mutex_unlock(&work.mu);
+
+        process_dir(path);
+        free(path);
+
+        pthread_mutex_lock(&work.mu);
+        work.active--;
+        if (work.len == 0 && work.active == 0) pthread_cond_broadcast(&work.cv);
+        pthread_mutex_unlock(&work.mu);
     }
-    free(copy);
-    return res;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
+    int recursive = 0;
+    long jobs = DEFAULT_JOBS;
+    int i = 1;
+    // Опции идут до MODE. "-w" и подобные - это уже MODE, а не опции.
+    for (; i < argc; ++i) {
+        if (strcmp(argv[i], "-R") == 0) {
+            recursive = 1;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *val = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : NULL);
+            char *end = NULL;
+            jobs = val ? strtol(val, &end, 10) : 0;
+            if (!val || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(stderr, "Неверное число потоков: %s\n", val ? val : "");
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--") == 0) {
+            ++i;
+            break;
+        } else {
+            break;
+        }
+    }
+
+    if (argc - i < 2) {
         usage(argv[0]);
         return 2;
     }
 
-    const char *mode_str = argv[1];
-    const char *path = argv[2];
-
-    struct stat st;
-    if (stat(path, &st) != 0) {
-        fprintf(stderr, "Ошибка stat('%s'): %s\n", path, strerror(errno));
+    const char *mode_arg = argv[i++];
+    if (compile_mode(mode_arg, &program) != 0) {
+        fprintf(stderr, "Неверный символьный режим: %s\n", mode_arg);
+        usage(argv[0]);
         return 2;
     }
 
-    mode_t new_mode = st.st_mode & 07777; // текущие биты (включая setuid/setgid/sticky если есть)
-    mode_t orig_mode = new_mode;
+    for (; i < argc; ++i) {
+        const char *path = argv[i];
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            fprintf(stderr, "Ошибка stat('%s'): %s\n", path, strerror(errno));
+            failed = 1;
+            continue;
+        }
 
-    if (is_octal_string(mode_str)) {
-        // числовой режим
-        mode_t parsed = parse_octal(mode_str);
-        // сохранить специальные биты (setuid, setgid, sticky) из старого режима, если пользователь не указывает их явно:
-        // Поведение стандартного chmod: если пользователь передаёт три цифры (rwx для u/g/o), то специальные биты сбрасываются.
-        // Но обычно chmod 4755 устанавливает setuid — то есть если пользователь явно дал 4-значный число, оно учитывается.
-        // Упростим: если длина строки == 3 — считаем, что пользователь не указывает спецбиты, т.е. чистые 3 цифры.
-        size_t len = strlen(mode_str);
-        if (len == 3) {
-            new_mode = (st.st_mode & ~0777) | (parsed & 0777); // сохранить спецбиты
-        } else {
-            // если длина >=4, возьмём всё что дали (включая спецбиты)
-            new_mode = parsed;
+        mode_t new_mode = run_mode(&program, st.st_mode);
+        if (new_mode != (st.st_mode & 07777) && chmod(path, new_mode) != 0) {
+            fprintf(stderr, "Ошибка chmod('%s', %o): %s\n", path, (unsigned)new_mode, strerror(errno));
+            failed = 1;
         }
-    } else {
-        // символьный режим
-        if (apply_symbolic(&new_mode, mode_str, orig_mode) != 0) {
-            fprintf(stderr, "Неверный символьный режим: %s\n", mode_str);
-            usage(argv[0]);
-            return 2;
+
+        // Символическую ссылку из аргументов меняем (её цель), но не обходим
+        struct stat lst;
+        if (recursive && S_ISDIR(st.st_mode) && lstat(path, &lst) == 0 && S_ISDIR(lst.st_mode)) {
+            char *copy = strdup(path);
+            if (!copy || work_push(copy) != 0) {
+                fprintf(stderr, "Ошибка обхода '%s': %s\n", path, strerror(ENOMEM));
+                free(copy);
+                failed = 1;
+            }
         }
     }
 
-    if (chmod(path, new_mode) != 0) {
-        fprintf(stderr, "Ошибка chmod('%s', %o): %s\n", path, new_mode & 07777, strerror(errno));
-        return 2;
+    if (work.len > 0) {
+        pthread_t tids[MAX_JOBS];
+        long started = 0;
+        for (long t = 1; t < jobs; ++t) {
+            if (pthread_create(&tids[started], NULL, walk_worker, NULL) == 0) started++;
+        }
+        walk_worker(NULL);
+        for (long t = 0; t < started; ++t) pthread_join(tids[t], NULL);
     }
+    free(work.paths);
+    free(program.ops);
 
-    return 0;
+    return failed ? 2 : 0;
 }